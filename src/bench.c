@@ -0,0 +1,164 @@
+#include "bench.h"
+#include "btree.h"
+#include "shadow.h"
+#include "shard.h"
+#include "storage.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_KEY_SIZE 24
+
+// Spreads consecutive indexes over the key space so inserts hit every leaf
+static uint64_t benchMix(uint64_t index) {
+  index ^= index >> 33;
+  index *= 0xff51afd7ed558ccdULL;
+  index ^= index >> 33;
+  return index;
+}
+
+static KeyValue benchKey(uint64_t index, char *buffer) {
+  int length = snprintf(buffer, BENCH_KEY_SIZE, "%016lx", benchMix(index));
+  KeyValue kv = {
+      .klen = length, .vlen = length, .key = buffer, .value = buffer};
+  return kv;
+}
+
+static void *benchInsertWorker(void *argument) {
+  BenchWorker *worker = argument;
+  char buffer[BENCH_KEY_SIZE];
+  for (uint64_t i = worker->first; i < worker->keys; i += worker->stride) {
+    KeyValue kv = benchKey(i, buffer);
+    int result = worker->db != NULL ? shardedInsert(worker->db, kv)
+                                    : insert(worker->tree, kv);
+    if (result != 1) {
+      worker->lost++;
+    }
+  }
+  return NULL;
+}
+
+static void *benchSearchWorker(void *argument) {
+  BenchWorker *worker = argument;
+  char buffer[BENCH_KEY_SIZE];
+  KeyValue found;
+  for (uint64_t i = worker->first; i < worker->keys; i += worker->stride) {
+    benchKey(i, buffer);
+    int result = worker->db != NULL
+                     ? shardedSearch(worker->db, buffer, &found)
+                     : searchKeyValue(worker->tree, buffer, &found);
+    if (result != 1) {
+      worker->misses++;
+      continue;
+    }
+    free(found.key);
+    free(found.value);
+  }
+  return NULL;
+}
+
+static double benchSeconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Runs one phase on every worker and returns how long it took
+static double benchRun(BenchWorker *workers, int threads,
+                       void *(*phase)(void *)) {
+  double start = benchSeconds();
+  for (int i = 0; i < threads; i++) {
+    pthread_create(&workers[i].thread, NULL, phase, &workers[i]);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  return benchSeconds() - start;
+}
+
+static void benchRemoveShards(ShardedDB *db) {
+  char filename[4096];
+  for (int i = 0; i < db->count; i++) {
+    snprintf(filename, sizeof(filename), SHARD_FILE_FORMAT, db->directory, i);
+    unlink(filename);
+  }
+  rmdir(db->directory);
+}
+
+/*
+Inserts `keys` keys from `threads` threads into a new database at filename,
+then looks them all up from the same threads, and prints the throughput of
+both. With shards > 0 filename is a directory of that many shard files,
+otherwise the tree is kept on the given storage, where memory measures the
+engine alone, with shadow paging when shadow is set. The database is removed
+afterwards.
+*/
+int benchInserts(char *filename, int threads, uint64_t keys, int shards,
+                 StorageKind kind, int shadow) {
+  if (threads < 1 || threads > BENCH_MAX_THREADS) {
+    printf("The benchmark runs 1 to %d threads\n", BENCH_MAX_THREADS);
+    return 0;
+  }
+  if (shadow && shards > 0) {
+    printf("Shadow paging is benchmarked on a single tree\n");
+    return 0;
+  }
+
+  BTree *tree = NULL;
+  ShardedDB *db = NULL;
+  if (shards > 0) {
+    db = shardedOpen(filename, shards);
+  } else {
+    char *name = kind == STORAGE_MEMORY ? NULL : filename;
+    Storage *storage = storageOpen(name, kind, 1);
+    tree = storage != NULL ? createTreeOn(storage, name) : NULL;
+    if (tree != NULL && shadow && enableShadowPaging(tree) != 1) {
+      closeTree(tree);
+      tree = NULL;
+    }
+  }
+  if (tree == NULL && db == NULL) {
+    return 0;
+  }
+
+  BenchWorker workers[BENCH_MAX_THREADS];
+  for (int i = 0; i < threads; i++) {
+    workers[i] = (BenchWorker){
+        .tree = tree, .db = db, .first = i, .stride = threads, .keys = keys};
+  }
+
+  double insertTime = benchRun(workers, threads, benchInsertWorker);
+  double searchTime = benchRun(workers, threads, benchSearchWorker);
+
+  uint64_t misses = 0;
+  uint64_t lost = 0;
+  for (int i = 0; i < threads; i++) {
+    misses += workers[i].misses;
+    lost += workers[i].lost;
+  }
+
+  printf("%d threads, %d shards, %lu keys%s\n", threads, shards, keys,
+         shadow ? ", shadow paging" : "");
+  printf("insert: %.3fs, %.0f ops/s\n", insertTime, keys / insertTime);
+  printf("search: %.3fs, %.0f ops/s\n", searchTime, keys / searchTime);
+  if (lost > 0) {
+    printf("%lu inserts were not applied\n", lost);
+  }
+  if (misses > 0) {
+    printf("%lu keys were not found\n", misses);
+  }
+
+  if (db != NULL) {
+    benchRemoveShards(db);
+    shardedClose(db);
+  } else {
+    closeTree(tree);
+    if (kind != STORAGE_MEMORY) {
+      unlink(filename);
+    }
+  }
+  return misses == 0 && lost == 0;
+}
@@ -0,0 +1,29 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "btree.h"
+#include "shard.h"
+#include "storage.h"
+#include <pthread.h>
+
+#define BENCH_MAX_THREADS 64
+
+/*
+Work of one benchmark thread: it handles every `stride`-th key starting at
+`first`, so the threads of a run share the key space without overlapping.
+*/
+typedef struct BenchWorker {
+  BTree *tree;
+  ShardedDB *db; // Used instead of tree when benchmarking shards
+  uint64_t first;
+  uint64_t stride;
+  uint64_t keys;
+  uint64_t lost; // Inserts that were not applied
+  uint64_t misses;
+  pthread_t thread;
+} BenchWorker;
+
+int benchInserts(char *filename, int threads, uint64_t keys, int shards,
+                 StorageKind kind, int shadow);
+
+#endif // BENCH_H
@@ -1,21 +1,26 @@
 #include "btree.h"
+#include "latch.h"
+#include "secondary.h"
+#include "shadow.h"
+#include "storage.h"
 #include "utils.h"
+#include "warmup.h"
 #include <assert.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
+#include <sys/file.h>
 
 #define HEADER 4
 #define POINTER 8
 #define OFFSET 2
 #define KEYVALUE 4
 
-#define BTREE_PAGE_SIZE                                                        \
-  4096 // TODO: change this to the actual disk page size (look it up)
-#define BTREE_MAX_KEY_SIZE 1000
-#define BTREE_MAX_VAL_SIZE 3000
+#define OLC_MAX_DEPTH 32
+#define OLC_MAX_RESTARTS 16
+
 
 void printKeyValue(KeyValue keyvalue) {
   uint16_t klen = keyvalue.klen;
@@ -48,7 +53,7 @@ void printTree(BTree *tree) {
   printf("T: %d | Root offset %lu | Last Offset %lu\n", tree->t, tree->root,
          tree->last);
   printf("Root: \n");
-  Node *root = nodeFromFile(tree->f, tree->root);
+  Node *root = nodeFromFile(tree->storage, tree->root);
   if (root == NULL) {
     printf("No root yet");
   } else {
@@ -56,14 +61,22 @@ void printTree(BTree *tree) {
   }
 }
 
+int isTombstone(KeyValue kv) { return kv.vlen == TOMBSTONE; }
+
+// Bytes the value takes on a page
+static uint16_t storedValueLength(KeyValue kv) {
+  return isTombstone(kv) ? 0 : kv.vlen;
+}
+
 KeyValue keyValueFromIndex(unsigned char *bytes, uint16_t index,
                            KeyOffset kvPos, uint16_t nkeys) {
 
   uint16_t klen = bytesToUInt16(bytes, kvPos);
   uint16_t vlen = bytesToUInt16(bytes, 2 + kvPos);
+  uint16_t stored = vlen == TOMBSTONE ? 0 : vlen;
 
   char *key = malloc(klen * sizeof(char));
-  char *value = malloc(vlen * sizeof(char));
+  char *value = malloc(stored * sizeof(char));
 
   uint16_t keyStart = kvPos + 4;
   uint16_t valStart = kvPos + 4 + klen;
@@ -72,7 +85,7 @@ KeyValue keyValueFromIndex(unsigned char *bytes, uint16_t index,
     key[i - keyStart] = bytes[i];
   }
 
-  for (uint16_t i = valStart; i < valStart + vlen; i++) {
+  for (uint16_t i = valStart; i < valStart + stored; i++) {
     value[i - valStart] = bytes[i];
   }
 
@@ -105,7 +118,6 @@ Node *nodeFromBytes(unsigned char *bytes) {
 
   int pointersStart = HEADER;
   int offsetsStart = pointersStart + (newNodeHeader.nkeys + 1) * POINTER;
-  int keysStart = offsetsStart + (newNodeHeader.nkeys) * OFFSET;
 
   // Load Pointers
   for (uint16_t i = 0; i < newNodeHeader.nkeys + 1; i++) {
@@ -117,20 +129,100 @@ Node *nodeFromBytes(unsigned char *bytes) {
     newNode->offsets[i] = offset;
 
     newNode->key_values[i] =
-        keyValueFromIndex(bytes, i, keysStart + offset, newNodeHeader.nkeys);
+        keyValueFromIndex(bytes, i, offset, newNodeHeader.nkeys);
   }
 
   return newNode;
 }
 
-int compare_key_value(const KeyValue kv1, const KeyValue kv2) {
-  // Compare based on key, assuming keys are strings
-  return strcmp(charArrayToString(kv1.key, kv1.klen),
-                charArrayToString(kv2.key, kv2.klen));
+// Bytes a key-value takes on a page
+uint16_t recordSize(KeyValue kv) {
+  return KEYVALUE + kv.klen + storedValueLength(kv);
+}
+
+// End of the pointers and offsets of a node holding nkeys key-values
+static uint64_t slotsEnd(uint16_t nkeys) {
+  return HEADER + (nkeys + 1) * POINTER + nkeys * OFFSET;
+}
+
+// Lowest offset of a key-value, the page end for an empty node
+static uint64_t heapStart(Node *node) {
+  uint64_t start = BTREE_PAGE_SIZE;
+  for (uint16_t i = 0; i < node->header.nkeys; i++) {
+    if (node->offsets[i] < start) {
+      start = node->offsets[i];
+    }
+  }
+  return start;
+}
+
+// Packs the key-values against the end of the page, in key order
+void recalculateOffsets(Node *node) {
+  uint64_t used = 0;
+  for (uint16_t j = 0; j < node->header.nkeys; j++) {
+    used += recordSize(node->key_values[j]);
+  }
+  assert(slotsEnd(node->header.nkeys) + used <= BTREE_PAGE_SIZE);
+
+  uint16_t currentBytes = BTREE_PAGE_SIZE - used;
+  for (uint16_t j = 0; j < node->header.nkeys; j++) {
+    node->offsets[j] = currentBytes;
+    currentBytes += recordSize(node->key_values[j]);
+  }
+}
+
+// Whether node, packed, fits its page with nkeys slots and extra more bytes
+static int nodeHasRoom(Node *node, uint16_t nkeys, uint64_t extra) {
+  uint64_t used = extra;
+  for (uint16_t j = 0; j < node->header.nkeys; j++) {
+    used += recordSize(node->key_values[j]);
+  }
+  return slotsEnd(nkeys) + used <= BTREE_PAGE_SIZE;
 }
 
-void addKVtoNode(Node *node, KeyValue kv) {
+// Whether node fits its page and holds no more than 2t - 1 keys
+static int nodeFits(BTree *tree, Node *node) {
+  return node->header.nkeys <= 2 * tree->t - 1 &&
+         nodeHasRoom(node, node->header.nkeys, 0);
+}
+
+// Whether node takes one more key-value with a record of size bytes
+int nodeTakes(BTree *tree, Node *node, uint64_t size) {
+  return node->header.nkeys < 2 * tree->t - 1 &&
+         nodeHasRoom(node, node->header.nkeys + 1, size);
+}
+
+static uint64_t largestRecord(Node *node) {
+  uint64_t largest = 0;
+  for (uint16_t j = 0; j < node->header.nkeys; j++) {
+    uint64_t size = recordSize(node->key_values[j]);
+    largest = size > largest ? size : largest;
+  }
+  return largest;
+}
+
+void freeNode(Node *node) {
+  if (node == NULL) {
+    return;
+  }
+  for (uint16_t i = 0; i < node->header.nkeys; i++) {
+    free(node->key_values[i].key);
+    free(node->key_values[i].value);
+  }
+  free(node->pointers);
+  free(node->offsets);
+  free(node->key_values);
+  free(node);
+}
+
+/*
+Adds kv to node in key order. Its record goes right below the others when
+the gap above the slots has room for it, so nothing else moves.
+Returns 1 when it did, 0 when the node had to be packed again.
+*/
+int addKVtoNode(Node *node, KeyValue kv) {
   int i = node->header.nkeys - 1;
+  uint64_t start = heapStart(node);
 
   // Reallocate key_values, offsets, and pointers
   node->key_values =
@@ -141,7 +233,7 @@ void addKVtoNode(Node *node, KeyValue kv) {
       realloc(node->pointers, (node->header.nkeys + 2) * sizeof(NodePointer));
 
   // Shift key_values, offsets, and pointers to make space for new elements
-  while (i >= 0 && compare_key_value(kv, node->key_values[i]) < 0) {
+  while (i >= 0 && compareKeyBytes(kv.key, kv.klen, node->key_values[i]) < 0) {
     node->key_values[i + 1] = node->key_values[i];
     node->offsets[i + 1] = node->offsets[i];
     node->pointers[i + 2] = node->pointers[i + 1];
@@ -151,153 +243,81 @@ void addKVtoNode(Node *node, KeyValue kv) {
   // Insert new key-value
   node->key_values[i + 1] = kv;
 
-  // Recalculate offsets
-  uint16_t currentBytes = 0;
-  for (uint16_t j = 0; j <= node->header.nkeys; j++) {
-    node->offsets[j] = currentBytes;
-    currentBytes += 4; // Size of klen and vlen fields
-    currentBytes += node->key_values[j].klen + node->key_values[j].vlen;
-  }
-
   // Increment the number of keys
   node->header.nkeys += 1;
-}
-
-uint64_t nodeByteSize(Node *node) {
-  uint64_t keyValueSize = 0;
 
-  for (uint16_t i = 0; i < node->header.nkeys; i++) {
-    keyValueSize += 4; // 2 bytes for klen and 2 bytes for vlen
-    keyValueSize += node->key_values[i].klen;
-    keyValueSize += node->key_values[i].vlen;
+  uint16_t size = recordSize(kv);
+  if (start >= slotsEnd(node->header.nkeys) + size) {
+    node->offsets[i + 1] = start - size;
+    return 1;
   }
-
-  uint64_t nodeSize = HEADER + (node->header.nkeys + 1) * POINTER +
-                      node->header.nkeys * OFFSET + keyValueSize;
-
-  return nodeSize;
+  recalculateOffsets(node);
+  return 0;
 }
 
-Node *nodeFromFile(FILE *db, uint64_t offset) {
-
-  Node *newNode = malloc(sizeof(Node));
-  if (newNode == NULL) {
-    free(newNode);
-    printf("Failed to malloc memory for node from file");
-    return NULL;
-  }
+/*
+Puts kv at index with right as the pointer after it, in memory only. The
+node may end up too large for its page, the offsets are left to whoever
+writes it.
+*/
+static void insertAt(Node *node, uint16_t index, KeyValue kv,
+                     NodePointer right) {
+  uint16_t nkeys = node->header.nkeys;
+  node->key_values =
+      realloc(node->key_values, (nkeys + 1) * sizeof(KeyValue));
+  node->offsets = realloc(node->offsets, (nkeys + 1) * sizeof(KeyOffset));
+  node->pointers = realloc(node->pointers, (nkeys + 2) * sizeof(NodePointer));
+  assert(node->key_values != NULL && node->offsets != NULL &&
+         node->pointers != NULL);
+
+  memmove(&node->key_values[index + 1], &node->key_values[index],
+          (nkeys - index) * sizeof(KeyValue));
+  memmove(&node->pointers[index + 2], &node->pointers[index + 1],
+          (nkeys - index) * sizeof(NodePointer));
+  node->key_values[index] = kv;
+  node->pointers[index + 1] = right;
+  node->header.nkeys++;
+}
 
-  if (fseek(db, offset, SEEK_SET) != 0) {
-    free(newNode);
+/*
+Reads a node with a single positioned read, without moving any file position,
+so many threads can read through the same storage at once.
+*/
+Node *nodeFromFile(Storage *storage, NodePointer offset) {
+  unsigned char page[BTREE_PAGE_SIZE];
+  memset(page, 0, BTREE_PAGE_SIZE);
+
+  // Pages are allocated whole, a short read leaves the rest zeroed
+  if (storageRead(storage, page, BTREE_PAGE_SIZE, offset) < HEADER) {
+    printf("Failed to read page %lu\n", offset);
     return NULL;
   }
 
-  unsigned char *headerBytes = malloc(HEADER * sizeof(char));
-  if (fread(headerBytes, HEADER, 1, db) != 1) {
-    free(newNode);
-    printf("Failed to read the header");
-    return 0;
-  }
-
-  NodeHeader header;
-  header.type = bytesToUInt16(headerBytes, 0);
-  header.nkeys = bytesToUInt16(headerBytes, 2);
-  free(headerBytes);
-
-  newNode->header = header;
-  newNode->self_pointer = offset;
-
-  newNode->pointers = malloc(sizeof(NodePointer) * (header.nkeys + 1));
-  newNode->offsets = malloc(sizeof(KeyOffset) * header.nkeys);
-  newNode->key_values = malloc(sizeof(KeyValue) * header.nkeys);
-
-  unsigned char *pointerBytes =
-      malloc(POINTER * sizeof(char) * (header.nkeys + 1));
-
-  if (fread(pointerBytes, POINTER, header.nkeys + 1, db) != header.nkeys + 1) {
-    // Handle read error or incomplete read
-    printf("Failed while reading pointers\n");
-    return 0;
-  }
-  for (uint16_t i = 0; i < header.nkeys + 1; i++) {
-    newNode->pointers[i] = bytesToUInt64(pointerBytes, (POINTER * i));
-  }
-  free(pointerBytes);
-
-  unsigned char *offsetBytes = malloc(OFFSET * sizeof(char) * header.nkeys);
-  if (fread(offsetBytes, OFFSET, header.nkeys, db) != header.nkeys) {
-    // Handle read error or incomplete read
-    printf("Failed while reading offsets\n");
-    return 0;
-  }
-  for (uint16_t i = 0; i < header.nkeys; i++) {
-    newNode->offsets[i] = bytesToUInt16(offsetBytes, (OFFSET * i));
-  }
-  free(offsetBytes);
-
-  unsigned char *keyvalueHeader = malloc(4 * sizeof(char));
-  uint16_t klen, vlen;
-  char *key, *value;
-  KeyValue kvalue;
-
-  for (uint16_t i = 0; i < header.nkeys; i++) {
-    if (fread(keyvalueHeader, 4 * sizeof(char), 1, db) != 1) {
-      printf("Failed while reading keyvalue header %d\n", i);
-      return 0;
-    }
-
-    klen = bytesToUInt16(keyvalueHeader, 0);
-    vlen = bytesToUInt16(keyvalueHeader, 2);
-
-    key = malloc(klen * sizeof(char));
-    value = malloc(vlen * sizeof(char));
-
-    if (fread(key, klen * sizeof(char), 1, db) != 1) {
-      // Handle read error or incomplete read
-      printf("Failed while reading key %d\n", i);
-      return 0;
-    }
-
-    if (fread(value, vlen * sizeof(char), 1, db) != 1) {
-      // Handle read error or incomplete read
-      printf("Failed while reading value %d\n", i);
-      return 0;
-    }
-
-    kvalue.klen = klen;
-    kvalue.vlen = vlen;
-    kvalue.key = key;
-    kvalue.value = value;
-
-    newNode->key_values[i] = kvalue;
-  }
-
-  return newNode;
+  Node *node = nodeFromBytes(page);
+  node->self_pointer = offset;
+  return node;
 }
 
-uint64_t nodeToBytes(Node *node, unsigned char **bytesPtr) {
-  uint64_t nodeSize = nodeByteSize(node);
-  unsigned char *bytes = malloc(nodeSize);
-
-  if (bytes == NULL) {
-    free(bytes);
-    return 0; // Indicate an error
-  }
-
+/*
+Lays node out on page. The gap between the slots and the key-values is never
+read, it is zeroed so whole-page writes don't put stack garbage on disk.
+*/
+static void nodeToPage(Node *node, unsigned char *page) {
+  memset(page, 0, BTREE_PAGE_SIZE);
   uint64_t currentByte = 0;
 
-  uint16ToBytes(node->header.type, bytes, currentByte);
-  uint16ToBytes(node->header.nkeys, bytes, currentByte + 2);
+  uint16ToBytes(node->header.type, page, currentByte);
+  uint16ToBytes(node->header.nkeys, page, currentByte + 2);
 
   currentByte += 4;
 
   for (uint16_t i = 0; i < node->header.nkeys + 1; i++) {
-    uint64ToBytes(node->pointers[i], bytes, currentByte);
+    uint64ToBytes(node->pointers[i], page, currentByte);
     currentByte += 8;
   }
 
   for (uint16_t i = 0; i < node->header.nkeys; i++) {
-    uint16ToBytes(node->offsets[i], bytes, currentByte);
+    uint16ToBytes(node->offsets[i], page, currentByte);
     currentByte += 2;
   }
 
@@ -305,119 +325,355 @@ uint64_t nodeToBytes(Node *node, unsigned char **bytesPtr) {
     uint16_t klen = node->key_values[i].klen;
     uint16_t vlen = node->key_values[i].vlen;
 
-    uint16ToBytes(klen, bytes, currentByte);
-    uint16ToBytes(vlen, bytes, currentByte + 2);
+    currentByte = node->offsets[i];
+    uint16ToBytes(klen, page, currentByte);
+    uint16ToBytes(vlen, page, currentByte + 2);
 
     currentByte += 4;
 
-    memcpy(bytes + currentByte, node->key_values[i].key, klen);
+    memcpy(page + currentByte, node->key_values[i].key, klen);
     currentByte += klen;
 
-    memcpy(bytes + currentByte, node->key_values[i].value, vlen);
-    currentByte += vlen;
+    uint16_t stored = storedValueLength(node->key_values[i]);
+    memcpy(page + currentByte, node->key_values[i].value, stored);
   }
+}
 
-  *bytesPtr = bytes; // Return the allocated memory to the caller
-  return nodeSize;
+/*
+| magic | version | page size | root | last | t  | generation | hot pages |
+|  8B   |   2B    |    4B     |  8B  |  8B  | 2B |     8B     |    8B     |
+
+| index count |          indexes           | flags | free list | checksum |
+|     2B      | 4 * (root 8B, prefix 2B)   |  2B   |    8B     |    4B    |
+The checksum covers everything before it. Unused index slots are zero.
+*/
+void treeHeaderToBytes(BTree *tree, unsigned char *bytes) {
+  memset(bytes, 0, TREE_HEADER_SIZE);
+  memcpy(bytes, TREE_MAGIC, TREE_MAGIC_SIZE);
+  uint16ToBytes(TREE_VERSION, bytes, 8);
+  uint32ToBytes(BTREE_PAGE_SIZE, bytes, 10);
+  uint64ToBytes(tree->root, bytes, 14);
+  uint64ToBytes(tree->last, bytes, 22);
+  uint16ToBytes(tree->t, bytes, 30);
+  uint64ToBytes(tree->generation, bytes, 32);
+  uint64ToBytes(tree->hotPages, bytes, 40);
+  uint16ToBytes(tree->indexCount, bytes, 48);
+  for (uint16_t i = 0; i < tree->indexCount; i++) {
+    NodePointer root = tree->indexes[i] != NULL ? tree->indexes[i]->root
+                                                : tree->indexRoots[i];
+    uint64ToBytes(root, bytes, 50 + i * 10);
+    uint16ToBytes(tree->indexPrefixes[i], bytes, 58 + i * 10);
+  }
+  uint16ToBytes(tree->flags, bytes, 90);
+  uint64ToBytes(tree->freeList, bytes, 92);
+  uint32ToBytes(checksumBytes(bytes, TREE_HEADER_SIZE - 4), bytes,
+                TREE_HEADER_SIZE - 4);
+}
+
+/*
+Loads the header, refusing anything that is not a complete header written by
+this version with the same page size.
+Returns 1 on success, 0 when the header is invalid.
+*/
+int treeHeaderFromBytes(BTree *tree, unsigned char *bytes) {
+  if (memcmp(bytes, TREE_MAGIC, TREE_MAGIC_SIZE) != 0) {
+    printf("Not a database file\n");
+    return 0;
+  }
+  if (bytesToUInt16(bytes, 8) != TREE_VERSION) {
+    printf("Unsupported database version %u\n", bytesToUInt16(bytes, 8));
+    return 0;
+  }
+  if (bytesToUInt32(bytes, 10) != BTREE_PAGE_SIZE) {
+    printf("The database uses %u byte pages, expected %u\n",
+           bytesToUInt32(bytes, 10), BTREE_PAGE_SIZE);
+    return 0;
+  }
+  if (bytesToUInt32(bytes, TREE_HEADER_SIZE - 4) !=
+          checksumBytes(bytes, TREE_HEADER_SIZE - 4) ||
+      bytesToUInt16(bytes, 48) > TREE_MAX_INDEXES) {
+    printf("The database header is corrupt\n");
+    return 0;
+  }
+  if ((bytesToUInt16(bytes, 90) & ~TREE_KNOWN_FLAGS) != 0) {
+    printf("The database uses features this version lacks\n");
+    return 0;
+  }
+
+  tree->root = bytesToUInt64(bytes, 14);
+  tree->last = bytesToUInt64(bytes, 22);
+  tree->t = bytesToUInt16(bytes, 30);
+  tree->generation = bytesToUInt64(bytes, 32);
+  tree->hotPages = bytesToUInt64(bytes, 40);
+  tree->indexCount = bytesToUInt16(bytes, 48);
+  for (uint16_t i = 0; i < tree->indexCount; i++) {
+    tree->indexRoots[i] = bytesToUInt64(bytes, 50 + i * 10);
+    tree->indexPrefixes[i] = bytesToUInt16(bytes, 58 + i * 10);
+  }
+  tree->flags = bytesToUInt16(bytes, 90);
+  tree->freeList = bytesToUInt64(bytes, 92);
+  return 1;
 }
 
 void updateTreeInFile(BTree *tree) {
-  if (fseek(tree->f, 0, SEEK_SET) != 0) { // Check for fseek error
-    perror("fseek failed");
-    exit(1);
+  // Indexes have no header of their own, their roots are in the owner's
+  if (tree->owner != NULL) {
+    updateTreeInFile(tree->owner);
+    return;
   }
 
-  // Write each field to the file
-  if (fwrite(&tree->root, sizeof(NodePointer), 1, tree->f) != 1 ||
-      fwrite(&tree->last, sizeof(NodePointer), 1, tree->f) != 1 ||
-      fwrite(&tree->t, sizeof(uint16_t), 1, tree->f) != 1) {
-    perror("fwrite failed");
+  // Writers allocating pages from several threads all rewrite the header
+  pthread_mutex_lock(&tree->headerLock);
+
+  unsigned char header[TREE_HEADER_SIZE];
+  treeHeaderToBytes(tree, header);
+
+  // A single write, so the root and generation change together
+  if (storageWrite(tree->storage, header, TREE_HEADER_SIZE, 0) !=
+      TREE_HEADER_SIZE) {
+    perror("Failed to write the tree header");
     exit(1);
   }
 
-  fflush(tree->f); // Flush the file buffer to ensure data is written
+  pthread_mutex_unlock(&tree->headerLock);
 }
 
-int addNodeToFile(BTree *tree, Node *node, NodePointer *destinationPointer) {
-
-  // TODO: check if there's any available page before just adding to the end
-
-  // Convert the node to bytes
-  unsigned char *nodeBytes = NULL;
-  uint64_t nodeSize = nodeToBytes(node, &nodeBytes);
+/*
+Hands out a page for a new node. Pages freed by shadow paging are reused
+before the file grows.
+*/
+NodePointer allocatePage(BTree *tree) {
+  if (tree->owner != NULL) {
+    return allocatePage(tree->owner);
+  }
 
-  // Write the node bytes to the file
-  if (fseek(tree->f, tree->last, SEEK_SET) != 0) {
-    // Handle file seek error
-    free(nodeBytes);
-    return 0;
+  NodePointer page;
+  if (tree->shadow != NULL && takeFreePage(tree, &page)) {
+    return page;
   }
 
-  if (fwrite(nodeBytes, 1, nodeSize, tree->f) != nodeSize) {
-    // Handle write error or incomplete write
-    free(nodeBytes);
-    return 0;
+  page = atomic_fetch_add(&tree->last, BTREE_PAGE_SIZE);
+  if (storageAllocate(tree->storage, page + BTREE_PAGE_SIZE) != 1) {
+    exit(1);
+  }
+  if (tree->shadow != NULL) {
+    markPageFresh(tree, page);
   }
+  return page;
+}
 
-  // Update the last pointer
-  *destinationPointer = tree->last; // Point to the current last page
-  tree->last += BTREE_PAGE_SIZE;    // Then update to the next page
+int addNodeToFile(BTree *tree, Node *node, NodePointer *destinationPointer) {
+  node->self_pointer = allocatePage(tree);
+  *destinationPointer = node->self_pointer;
 
-  // Clean up
-  free(nodeBytes);
+  if (updateNodeOnFile(tree, node) != 1) {
+    return 0;
+  }
 
-  updateTreeInFile(tree);
-  // Return success
+  // With shadow paging the header is only written when the transaction
+  // commits
+  if (tree->shadow == NULL) {
+    updateTreeInFile(tree);
+  }
   return 1;
 }
 
+// Writes bytes from to to of the page image of node, if any
+static int writeNodeRange(BTree *tree, Node *node, unsigned char *page,
+                          uint64_t from, uint64_t to) {
+  if (from >= to) {
+    return 1;
+  }
+  return storageWrite(tree->storage, page + from, to - from,
+                      node->self_pointer + from) == (ssize_t)(to - from);
+}
+
+// Writes the slots and the key-values of node, skipping the free gap
 int updateNodeOnFile(BTree *tree, Node *node) {
-  unsigned char *nodeBytes = NULL;
-  uint64_t nodeSize = nodeToBytes(node, &nodeBytes);
+  unsigned char page[BTREE_PAGE_SIZE];
+  nodeToPage(node, page);
 
-  if (nodeBytes == NULL) {
+  return writeNodeRange(tree, node, page, 0, slotsEnd(node->header.nkeys)) &&
+         writeNodeRange(tree, node, page, heapStart(node), BTREE_PAGE_SIZE);
+}
+
+int initTreeLatches(BTree *tree) {
+  tree->latches = latchTableCreate();
+  if (tree->latches == NULL) {
     return 0;
   }
+  pthread_mutex_init(&tree->headerLock, NULL);
+  pthread_rwlock_init(&tree->writeLock, NULL);
+  return 1;
+}
 
-  // Write the node bytes to the file
-  if (fseek(tree->f, node->self_pointer, SEEK_SET) != 0) {
-    // Handle file seek error
-    free(nodeBytes);
+void destroyTreeLatches(BTree *tree) {
+  latchTableFree(tree->latches);
+  pthread_mutex_destroy(&tree->headerLock);
+  pthread_rwlock_destroy(&tree->writeLock);
+}
+
+/*
+Rereads the header, for handles sharing the file with other processes that
+may have moved the root, grown the file or turned on shadow paging since.
+*/
+int reloadTreeHeader(BTree *tree) {
+  unsigned char header[TREE_HEADER_SIZE];
+  if (storageRead(tree->storage, header, TREE_HEADER_SIZE, 0) !=
+      TREE_HEADER_SIZE) {
+    printf("Failed to read the tree header.\n");
     return 0;
   }
 
-  if (fwrite(nodeBytes, 1, nodeSize, tree->f) != nodeSize) {
-    // Handle write error or incomplete write
-    free(nodeBytes);
+  pthread_mutex_lock(&tree->headerLock);
+  int ok = treeHeaderFromBytes(tree, header);
+  pthread_mutex_unlock(&tree->headerLock);
+  if (ok != 1 || openIndexes(tree) != 1) {
     return 0;
   }
 
-  free(nodeBytes);
+  if (tree->flags & TREE_SHADOW_PAGING) {
+    if (tree->shadow == NULL) {
+      return enableShadowPaging(tree);
+    }
+    shadowPublish(tree);
+  }
   return 1;
 }
 
-BTree *treeFromFileName(char *filename) {
+/*
+Points the tree at new storage holding the tree rooted at root. The old root
+is latched meanwhile, so a lookup that started on the old storage either
+finishes there or sees the root's version move and starts over on the new
+one. The old storage stays open for such lookups until the tree is closed.
+The caller holds writeLock exclusively.
+*/
+void replaceStorage(BTree *tree, Storage *storage, NodePointer root) {
+  tree->retiredStorages =
+      realloc(tree->retiredStorages,
+              (tree->retiredCount + 1) * sizeof(Storage *));
+  assert(tree->retiredStorages != NULL);
+  tree->retiredStorages[tree->retiredCount++] = tree->storage;
+
+  NodePointer oldRoot = tree->root;
+  latchExclusive(tree->latches, oldRoot);
+  tree->storage = storage;
+  tree->root = root;
+  unlatch(tree->latches, oldRoot);
+}
 
-  BTree *result = malloc(sizeof(BTree));
+/*
+Takes the flock of the tree's file, operation being LOCK_SH or LOCK_EX, and
+rereads the header. A compaction in another process may have moved a new
+file over this one while it waited, anything written to the old file would
+be lost, so the new file is opened and locked instead.
+Returns 1 on success, 0 on failure.
+*/
+int lockTree(BTree *tree, int operation) {
+  for (;;) {
+    Storage *storage = tree->storage;
+    if (storageLock(storage, operation) != 1) {
+      return 0;
+    }
+    if (tree->filename == NULL ||
+        !storageReplaced(storage, tree->filename)) {
+      break;
+    }
 
-  // TODO -> add more stuff, like loading the tree from the header of the file
+    Storage *current = storageOpen(tree->filename, storage->kind, 0);
+    storageLock(storage, LOCK_UN);
+    if (current == NULL) {
+      return 0;
+    }
+    pthread_rwlock_wrlock(&tree->writeLock);
+    replaceStorage(tree, current, tree->root);
+    pthread_rwlock_unlock(&tree->writeLock);
+  }
 
-  // Open the file for reading (change "r" to other modes for different
-  // operations)
-  FILE *file = fopen(filename, "r");
+  tree->locked = operation;
+  return reloadTreeHeader(tree);
+}
 
-  // Check if the file was opened successfully
-  if (file == NULL) {
-    printf("Failed to open the file.\n");
-    return NULL; // Return non-zero to indicate an error
+void unlockTree(BTree *tree) {
+  tree->locked = 0;
+  storageLock(tree->storage, LOCK_UN);
+}
+
+/*
+Closes the tree cleanly, leaving the list of its hottest pages behind for the
+next open to warm up, and with shadow paging the list of its free pages.
+Under a shared flock other processes read the file too, nothing is written.
+*/
+void closeTree(BTree *tree) {
+  if (tree == NULL) {
+    return;
+  }
+  finishWarmup(tree->warmup);
+  if (tree->locked != LOCK_SH) {
+    saveHotPages(tree);
+    if (tree->shadow != NULL) {
+      shadowSaveFreeList(tree);
+    }
+  }
+  closeIndexes(tree);
+  storageClose(tree->storage);
+  for (int i = 0; i < tree->retiredCount; i++) {
+    storageClose(tree->retiredStorages[i]);
   }
+  free(tree->retiredStorages);
+  shadowFree(tree->shadow);
+  destroyTreeLatches(tree);
+  free(tree->filename);
+  free(tree);
+}
 
-  result->f = file;
-  result->root = 0;
+/*
+Loads the tree whose header updateTreeInFile wrote to storage. The tree owns
+the storage from then on, even when loading fails. filename is NULL for
+in-memory trees.
+*/
+BTree *treeFromStorage(Storage *storage, char *filename) {
+  BTree *result = calloc(1, sizeof(BTree));
+  if (result == NULL || initTreeLatches(result) != 1) {
+    perror("Memory allocation failed");
+    storageClose(storage);
+    free(result);
+    return NULL;
+  }
 
+  // Only the header is read, the pages are warmed up in the background
+  unsigned char header[TREE_HEADER_SIZE];
+  if (storageRead(storage, header, TREE_HEADER_SIZE, 0) != TREE_HEADER_SIZE ||
+      treeHeaderFromBytes(result, header) != 1) {
+    printf("Failed to load the tree header.\n");
+    storageClose(storage);
+    destroyTreeLatches(result);
+    free(result);
+    return NULL;
+  }
+
+  result->storage = storage;
+  result->shadow = NULL;
+  result->filename = filename != NULL ? strdup(filename) : NULL;
+  if (openIndexes(result) != 1 ||
+      ((result->flags & TREE_SHADOW_PAGING) &&
+       enableShadowPaging(result) != 1)) {
+    closeTree(result);
+    return NULL;
+  }
+  result->warmup = startWarmup(result);
   return result;
 }
 
+BTree *treeFromFileName(char *filename) {
+  // Open the file for reading and writing, the tree may be compacted in place
+  Storage *storage = storageOpen(filename, STORAGE_FILE, 0);
+  if (storage == NULL) {
+    return NULL;
+  }
+  return treeFromStorage(storage, filename);
+}
+
 Node *createEmptyNode(uint16_t t) {
   Node *result = malloc(sizeof(Node));
   if (result == NULL) {
@@ -469,78 +725,95 @@ Node *createNode(int type, int t) {
   return new_node;
 }
 
-BTree *createMockupTree() {
-  const char *filename = "/home/guilherme/Projetos/canonical/db.bin";
-  FILE *file = fopen(filename, "w+b"); // Open in binary read-write mode
-
-  if (file == NULL) {
-    perror("Failed to open the file");
-    return NULL;
-  }
-
-  BTree *result = malloc(sizeof(BTree));
-  if (result == NULL) {
+/*
+Starts an empty tree on new storage, which the tree owns from then on.
+filename is NULL for in-memory trees.
+*/
+BTree *createTreeOn(Storage *storage, char *filename) {
+  BTree *result = calloc(1, sizeof(BTree));
+  if (result == NULL || initTreeLatches(result) != 1) {
     perror("Memory allocation failed");
-    fclose(file);
+    storageClose(storage);
+    free(result);
     return NULL;
   }
 
-  result->f = file;
+  result->storage = storage;
+  result->filename = filename != NULL ? strdup(filename) : NULL;
+  result->shadow = NULL;
+  result->warmup = NULL;
+  result->hotPages = 0;
+  result->generation = 0;
   result->root = BTREE_PAGE_SIZE;
   result->last = BTREE_PAGE_SIZE;
-  result->t = 4;
+  result->t = BTREE_DEFAULT_T;
 
-  // Create an empty root node as a leaf
+  // Start with an empty leaf as the root
   Node *rootNode = createEmptyNode(result->t);
   rootNode->header.type = LEAF;
 
-  KeyValue mock = {.klen = 1,
-                   .vlen = 1,
-                   .key = stringToCharArray("k"),
-                   .value = stringToCharArray("v")};
-
-  addKVtoNode(rootNode, mock);
-
   NodePointer destination;
   if (addNodeToFile(result, rootNode, &destination) != 1) {
+    printf("Failed to write the root of the tree\n");
+    freeNode(rootNode);
+    closeTree(result);
+    return NULL;
+  }
+  freeNode(rootNode);
+
+  return result;
+}
+
+BTree *createTree(char *filename) {
+  Storage *storage = storageOpen(filename, STORAGE_FILE, 1);
+  if (storage == NULL) {
+    return NULL;
+  }
+  return createTreeOn(storage, filename);
+}
+
+// In-memory tree holding a single key-value, for experiments
+BTree *createMockupTree() {
+  Storage *storage = storageOpen(NULL, STORAGE_MEMORY, 1);
+  if (storage == NULL) {
+    return NULL;
+  }
+
+  BTree *result = createTreeOn(storage, NULL);
+  if (result == NULL) {
     printf("ERROR WHILE CREATING MOCKUP TREE\n");
-    fclose(file);
-    free(result); // Clean up the allocated memory
     return NULL;
   }
 
-  // Seek to the beginning of the file and update the root pointer
-  // fseek(result->f, 0, SEEK_SET);
-  // if (fwrite(&(result->root), sizeof(NodePointer), 1, result->f) != 1) {
-  //  perror("Error writing root pointer");
-  //  fclose(file);
-  //  free(result); // Clean up the allocated memory
-  //  return NULL;
-  //}
-  fseek(result->f, 0, SEEK_SET);
-  updateTreeInFile(result);
+  KeyValue mock = {.klen = 1, .vlen = 1, .key = "k", .value = "v"};
+  insert(result, mock);
 
   return result;
 }
 
-uint16_t getNextChild(Node *currentNode, char *key) {
-  for (uint16_t i = 0; i < currentNode->header.nkeys + 1; i++) {
-    KeyValue currentKeyvalue = currentNode->key_values[i];
-    int cmp = memcmp(key, currentKeyvalue.key, currentKeyvalue.klen);
-    if (cmp <= 0) {
+int compareKeyBytes(const char *key, uint16_t klen, KeyValue kv) {
+  uint16_t len = klen < kv.klen ? klen : kv.klen;
+  int cmp = memcmp(key, kv.key, len);
+  if (cmp != 0) {
+    return cmp;
+  }
+  return (int)klen - (int)kv.klen;
+}
+
+// Index of the child that may hold key, equal keys go right
+uint16_t getNextChild(Node *currentNode, const char *key, uint16_t klen) {
+  for (uint16_t i = 0; i < currentNode->header.nkeys; i++) {
+    if (compareKeyBytes(key, klen, currentNode->key_values[i]) < 0) {
       return i;
-    } else {
-      break;
     }
   }
-  return 0;
+  return currentNode->header.nkeys;
 }
 
-int getKeyInNode(Node *node, char *key) {
+// Position of key in node, -1 when the node doesn't hold it
+int getKeyInNode(Node *node, const char *key, uint16_t klen) {
   for (uint16_t i = 0; i < node->header.nkeys; i++) {
-    KeyValue currentKeyvalue = node->key_values[i];
-    int cmp = memcmp(key, currentKeyvalue.key, currentKeyvalue.klen);
-    if (cmp == 0) {
+    if (compareKeyBytes(key, klen, node->key_values[i]) == 0) {
       return i;
     }
   }
@@ -548,130 +821,692 @@ int getKeyInNode(Node *node, char *key) {
   return -1;
 }
 
-int searchKeyValue(BTree *tree, char *key, KeyValue *foundKv) {
-  // Start searching from the root
-  NodePointer currentPointer = tree->root;
-  Node *currentNode = nodeFromFile(tree->f, currentPointer);
+// Latches the root page, retrying if a split installed a new root meanwhile
+static NodePointer latchRoot(BTree *tree) {
+  for (;;) {
+    NodePointer root = tree->root;
+    latchExclusive(tree->latches, root);
+    if (root == tree->root) {
+      return root;
+    }
+    unlatch(tree->latches, root);
+  }
+}
+
+// Same as latchRoot for optimistic readers
+static NodePointer readRootBegin(BTree *tree, uint64_t *version) {
+  for (;;) {
+    NodePointer root = tree->root;
+    *version = latchReadBegin(tree->latches, root);
+    if (root == tree->root) {
+      return root;
+    }
+  }
+}
 
-  while (currentNode != NULL) {
+/*
+Root of the tree and the storage holding it. The root's version moves when
+compaction replaces the storage, so they are known to go together once it
+is validated.
+*/
+static NodePointer readRootStorage(BTree *tree, Storage **storage) {
+  for (;;) {
+    uint64_t version;
+    NodePointer root = readRootBegin(tree, &version);
+    *storage = tree->storage;
+    if (latchValidate(tree->latches, root, version)) {
+      return root;
+    }
+  }
+}
 
-    int keyIndex = getKeyInNode(currentNode, key);
-    if (keyIndex != -1) {
-      KeyValue kv = currentNode->key_values[keyIndex];
+/*
+Copies a page with a single read and only hands it out once its version shows
+no writer touched it meanwhile, a torn copy is never looked at.
+Returns 1 with the page in bytes, 0 when the page changed and -1 on a read
+error.
+*/
+static int pageFromFileOptimistic(BTree *tree, Storage *storage,
+                                  NodePointer page, uint64_t version,
+                                  unsigned char *bytes) {
+  memset(bytes, 0, BTREE_PAGE_SIZE);
+
+  latchTouch(tree->latches, page);
+  ssize_t length = storageRead(storage, bytes, BTREE_PAGE_SIZE, page);
+  if (!latchValidate(tree->latches, page, version)) {
+    return 0;
+  }
+  if (length < HEADER) {
+    printf("Failed to read page %lu\n", page);
+    return -1;
+  }
+  return 1;
+}
+
+// Like pageFromFileOptimistic, returning the parsed node instead
+static int nodeFromFileOptimistic(BTree *tree, Storage *storage,
+                                  NodePointer page, uint64_t version,
+                                  Node **node) {
+  unsigned char bytes[BTREE_PAGE_SIZE];
+  int status = pageFromFileOptimistic(tree, storage, page, version, bytes);
+  if (status != 1) {
+    return status;
+  }
 
-      foundKv->klen = kv.klen;
-      foundKv->vlen = kv.vlen;
-      foundKv->key = kv.key;
-      foundKv->value = kv.value;
+  *node = nodeFromBytes(bytes);
+  (*node)->self_pointer = page;
+  return 1;
+}
+
+// Returns 0 when a page changed under the lookup and it must start over
+static int searchOptimistic(BTree *tree, const char *key, uint16_t klen,
+                            KeyValue *foundKv) {
+  uint64_t version;
+  NodePointer pointer = readRootBegin(tree, &version);
+  // Validating the root's version checks it was read from this storage
+  Storage *storage = tree->storage;
+  Node *node;
+  int status = nodeFromFileOptimistic(tree, storage, pointer, version, &node);
+
+  while (status == 1) {
+    int keyIndex = getKeyInNode(node, key, klen);
+    if (keyIndex != -1 && isTombstone(node->key_values[keyIndex])) {
+      freeNode(node);
+      return -1;
+    }
+    if (keyIndex != -1) {
+      *foundKv = node->key_values[keyIndex];
+      node->key_values[keyIndex].key = NULL;
+      node->key_values[keyIndex].value = NULL;
+      freeNode(node);
       return 1;
-    } else {
-      if (currentNode->header.type == LEAF) {
-        return -1;
-      }
-      uint16_t nextChildIndex = getNextChild(currentNode, key);
-      currentPointer = currentNode->pointers[nextChildIndex];
-      currentNode = nodeFromFile(tree->f, currentPointer);
     }
+
+    if (node->header.type == LEAF) {
+      freeNode(node);
+      return -1;
+    }
+
+    NodePointer child = node->pointers[getNextChild(node, key, klen)];
+    freeNode(node);
+
+    // The parent must still be unchanged once the child's version is known,
+    // otherwise a split may have moved the key to a sibling
+    uint64_t childVersion = latchReadBegin(tree->latches, child);
+    if (!latchValidate(tree->latches, pointer, version)) {
+      return 0;
+    }
+    pointer = child;
+    version = childVersion;
+    status = nodeFromFileOptimistic(tree, storage, pointer, version, &node);
   }
 
-  // Key not found
-  return -1;
+  return status == 0 ? 0 : -1;
 }
 
-void splitChild(BTree *tree, Node *x, int i, int t) {
-  Node *y = nodeFromFile(tree->f, x->pointers[i]);
-  assert(y != NULL);
+/*
+Looks up the klen bytes of key without taking any latch, starting over
+whenever a writer changed a page on the way. Keys may hold any bytes, see
+keys.h. On success foundKv owns its key and value.
+*/
+int searchKeyBytes(BTree *tree, const char *key, uint16_t klen,
+                   KeyValue *foundKv) {
+  if (tree->shadow != NULL) {
+    // Pages written in place are only safe to read through a snapshot
+    Snapshot snapshot;
+    while (snapshotAcquire(tree, &snapshot) != 1) {
+      sched_yield();
+    }
+    int found = snapshotSearch(tree, &snapshot, key, klen, foundKv);
+    snapshotRelease(tree, &snapshot);
+    return found;
+  }
 
-  Node *z = createNode(y->header.type, t);
-  assert(z != NULL);
+  for (;;) {
+    int found = searchOptimistic(tree, key, klen, foundKv);
+    if (found != 0) {
+      return found;
+    }
+  }
+}
 
-  // Move half of y's key-values and pointers to z
-  for (int j = 0; j < t - 1; j++) {
-    z->key_values[j] = y->key_values[j + t];
+// searchKeyBytes for a text key
+int searchKeyValue(BTree *tree, char *key, KeyValue *foundKv) {
+  return searchKeyBytes(tree, key, strlen(key), foundKv);
+}
+
+typedef struct PathEntry {
+  NodePointer page;
+  uint64_t version;
+  Node *node;
+} PathEntry;
+
+static void freePath(PathEntry *path, int depth) {
+  for (int level = 0; level < depth; level++) {
+    freeNode(path[level].node);
   }
+}
+
+// Bytes a key-value takes in a node, its offset and pointer included
+static uint64_t entrySize(KeyValue kv) {
+  return recordSize(kv) + OFFSET + POINTER;
+}
 
-  if (y->header.type == INTERNAL) {
-    for (int j = 0; j < t; j++) {
-      z->pointers[j] = y->pointers[j + t];
+/*
+Splits node, which doesn't fit its page, at the key-value where its bytes
+reach half. node keeps the key-values before it on its page, those after it
+move to a new page, and the median and that page are handed back for the
+parent. Neither half gets more than half the bytes, so both fit even after
+the node took a record as large as the limits allow.
+*/
+static void splitNode(BTree *tree, Node *node, KeyValue *median,
+                      NodePointer *right) {
+  uint16_t nkeys = node->header.nkeys;
+  uint64_t total = 0;
+  for (uint16_t j = 0; j < nkeys; j++) {
+    total += entrySize(node->key_values[j]);
+  }
+  uint16_t m = 0;
+  uint64_t before = 0;
+  while (m < nkeys - 1 &&
+         before + entrySize(node->key_values[m]) <= total / 2) {
+    before += entrySize(node->key_values[m]);
+    m++;
+  }
+
+  Node *sibling = createNode(node->header.type, tree->t);
+  sibling->header.nkeys = nkeys - m - 1;
+  memcpy(sibling->key_values, &node->key_values[m + 1],
+         sibling->header.nkeys * sizeof(KeyValue));
+  memcpy(sibling->pointers, &node->pointers[m + 1],
+         (sibling->header.nkeys + 1) * sizeof(NodePointer));
+  *median = node->key_values[m];
+  node->header.nkeys = m;
+
+  recalculateOffsets(node);
+  recalculateOffsets(sibling);
+  // The new page is only reachable once the parent is written
+  if (addNodeToFile(tree, sibling, right) != 1) {
+    exit(1);
+  }
+  updateNodeOnFile(tree, node);
+  freeNode(sibling);
+}
+
+// Puts a new root above left, the old root, and right, split from it
+static void growRoot(BTree *tree, NodePointer left, KeyValue median,
+                     NodePointer right) {
+  Node *root = createNode(INTERNAL, tree->t);
+  root->header.nkeys = 1;
+  root->key_values[0] = median;
+  root->pointers[0] = left;
+  root->pointers[1] = right;
+  recalculateOffsets(root);
+
+  NodePointer pointer;
+  if (addNodeToFile(tree, root, &pointer) != 1) {
+    exit(1);
+  }
+  // Switch the root while the old one is still latched, so anyone who
+  // latched it meanwhile sees the change and starts over
+  tree->root = pointer;
+  if (tree->shadow == NULL) {
+    updateTreeInFile(tree);
+  }
+  freeNode(root);
+}
+
+/*
+Writes path[level].node, which took a key-value or a longer value and may no
+longer fit its page. A node that doesn't fit is split and its median goes up
+to the parent, for as long as the parents overflow. Every node from
+path[top] down is latched exclusively. path[top] only splits when it is the
+root latched through latchRoot, the tree then grows a new root.
+*/
+static void settlePath(BTree *tree, PathEntry *path, int top, int level) {
+  Node *node = path[level].node;
+  while (!nodeFits(tree, node)) {
+    KeyValue median;
+    NodePointer right;
+    splitNode(tree, node, &median, &right);
+    if (level == top) {
+      assert(top == 0);
+      growRoot(tree, node->self_pointer, median, right);
+      return;
     }
+    level--;
+    node = path[level].node;
+    insertAt(node, getNextChild(node, median.key, median.klen), median,
+             right);
+  }
+  recalculateOffsets(node);
+  updateNodeOnFile(tree, node);
+}
+
+static char *copyBytes(const char *bytes, uint16_t length) {
+  char *copy = malloc(length);
+  assert(copy != NULL || length == 0);
+  if (length > 0) {
+    memcpy(copy, bytes, length);
   }
+  return copy;
+}
 
-  // Update y's number of keys
-  y->header.nkeys = t - 1;
+// Nodes own their key-values, callers keep their own copy
+static KeyValue copyKeyValue(KeyValue kv) {
+  KeyValue copy = {.klen = kv.klen,
+                   .vlen = kv.vlen,
+                   .key = copyBytes(kv.key, kv.klen),
+                   .value = copyBytes(kv.value, storedValueLength(kv))};
+  return copy;
+}
 
-  // Shift x's pointers and key-values to make room for new elements
-  for (int j = x->header.nkeys; j >= i + 1; j--) {
-    x->pointers[j + 1] = x->pointers[j];
+// Writes the record of the key-value at index, then the slots pointing to it
+static int writeNewRecord(BTree *tree, Node *node, int index) {
+  unsigned char page[BTREE_PAGE_SIZE];
+  nodeToPage(node, page);
+  uint16_t record = node->offsets[index];
+  return writeNodeRange(tree, node, page, record,
+                        record + recordSize(node->key_values[index])) &&
+         writeNodeRange(tree, node, page, 0, slotsEnd(node->header.nkeys));
+}
+
+/*
+Adds key_value to path[level], a leaf latched exclusively like every node up
+to path[top]. When the other key-values stay where they are only the new
+record and the slots are written. Shadow paging always writes the whole
+node, the leaf may be on a page nobody wrote yet. A leaf without room splits,
+see settlePath.
+*/
+static void insertIntoLeaf(BTree *tree, PathEntry *path, int top, int level,
+                           KeyValue key_value) {
+  Node *leaf = path[level].node;
+  if (!nodeTakes(tree, leaf, recordSize(key_value))) {
+    insertAt(leaf, getNextChild(leaf, key_value.key, key_value.klen),
+             copyKeyValue(key_value), 0);
+    settlePath(tree, path, top, level);
+    return;
   }
-  for (int j = x->header.nkeys - 1; j >= i; j--) {
-    x->key_values[j + 1] = x->key_values[j];
+  if (addKVtoNode(leaf, copyKeyValue(key_value)) && tree->shadow == NULL &&
+      writeNewRecord(tree, leaf,
+                     getKeyInNode(leaf, key_value.key, key_value.klen))) {
+    return;
   }
+  updateNodeOnFile(tree, leaf);
+}
 
-  // Insert median key-value from y to x
-  x->key_values[i] = y->key_values[t - 1];
-  x->header.nkeys++;
+/*
+Settles what mutation writes over current, which is NULL when the key is
+missing or deleted. Deleting a key that has no value writes nothing, and a
+record past BTREE_MAX_RECORD_SIZE is refused.
+Returns 1 with mutation->result set, 0 when the update declined.
+*/
+static int mutationValue(Mutation *mutation, const KeyValue *current) {
+  mutation->result = mutation->kv;
+  if (mutation->update != NULL &&
+      mutation->update(mutation->context, current, &mutation->result) != 1) {
+    return 0;
+  }
+  if (current == NULL && isTombstone(mutation->result)) {
+    return 0;
+  }
+  if (KEYVALUE + mutation->kv.klen + storedValueLength(mutation->result) >
+      BTREE_MAX_RECORD_SIZE) {
+    return 0;
+  }
+  mutation->result.key = mutation->kv.key;
+  mutation->result.klen = mutation->kv.klen;
+  mutation->applied = 1;
+  return 1;
+}
 
-  // Update x's pointers to include z
-  NodePointer destinationZ;
-  if (addNodeToFile(tree, z, &destinationZ) != 1) {
-    exit(1);
+/*
+Writes the length and value of the record at index over the old ones on the
+page, for values no longer than before. Space a shorter value leaves behind
+is reclaimed when the node is packed again.
+*/
+static int updateValueOnFile(BTree *tree, Node *node, int index) {
+  unsigned char page[BTREE_PAGE_SIZE];
+  nodeToPage(node, page);
+  uint16_t record = node->offsets[index];
+  return writeNodeRange(tree, node, page, record + 2,
+                        record + recordSize(node->key_values[index]));
+}
+
+// Gives the key-value at index the value mutation settled on, in memory
+static void storeValue(Node *node, int index, Mutation *mutation) {
+  KeyValue *slot = &node->key_values[index];
+  int live = !isTombstone(*slot);
+  if (live && mutation->previous != NULL) {
+    *mutation->previous = copyKeyValue(*slot);
   }
-  x->pointers[i + 1] = destinationZ;
+  mutation->replaced = live;
 
-  // Update nodes in file
-  updateNodeOnFile(tree, x);
-  updateNodeOnFile(tree, y);
-  updateNodeOnFile(tree, z);
+  free(slot->value);
+  slot->value = copyBytes(mutation->result.value,
+                          storedValueLength(mutation->result));
+  slot->vlen = mutation->result.vlen;
 }
 
-void insertNonFull(BTree *tree, Node *x, KeyValue key_value) {
-  int i = x->header.nkeys - 1;
-  if (x->header.type == LEAF) {
-    addKVtoNode(x, key_value);
-    updateNodeOnFile(tree, x);
-  } else {
-    while (i >= 0 && compare_key_value(key_value, x->key_values[i]) < 0) {
-      i--;
-    }
-    i++;
-    // Load the child node pointed to by x->pointers[i]
-    Node *child = nodeFromFile(tree->f, x->pointers[i]);
-    if (child->header.nkeys == (2 * tree->t) - 1) {
-      // The child is full, split it
-      splitChild(tree, x, i, tree->t);
-      // Decide which of the two children to descend to
-      if (compare_key_value(key_value, x->key_values[i]) > 0) {
-        i++;
+/*
+Applies mutation to the key-value at index in node, which is latched
+exclusively. A value that fits where the old one was is written in place,
+anything else rewrites the node. Shadow paging never writes in place, the
+node may be on a page nobody wrote yet.
+Returns 1 when done, 0 when the new value only fits once the node splits.
+The node is left alone then, with mutation->result settled for storeValue.
+*/
+static int replaceValue(BTree *tree, Node *node, int index,
+                        Mutation *mutation) {
+  KeyValue *slot = &node->key_values[index];
+  if (mutationValue(mutation, isTombstone(*slot) ? NULL : slot) != 1) {
+    return 1;
+  }
+  uint16_t oldLength = storedValueLength(*slot);
+  uint16_t newLength = storedValueLength(mutation->result);
+  if (newLength > oldLength &&
+      !nodeHasRoom(node, node->header.nkeys, newLength - oldLength)) {
+    return 0;
+  }
+  storeValue(node, index, mutation);
+
+  if (tree->shadow == NULL && newLength <= oldLength &&
+      updateValueOnFile(tree, node, index)) {
+    return 1;
+  }
+  recalculateOffsets(node);
+  updateNodeOnFile(tree, node);
+  return 1;
+}
+
+/*
+Pessimistic insert. Latches exclusively from the root down and keeps the
+whole path latched, so splits go up as far as they need to, through the root
+if it comes to that. A key already on the way down is mutated where it is.
+*/
+static void insertLocked(BTree *tree, Mutation *mutation) {
+  if (tree->shadow != NULL) {
+    shadowBegin(tree);
+  }
+
+  KeyValue key_value = mutation->kv;
+  PathEntry *path = NULL;
+  int depth = 0;
+
+  NodePointer rootPointer = latchRoot(tree);
+  Node *node = nodeFromFile(tree->storage, rootPointer);
+  assert(node != NULL);
+  if (shadowNode(tree, node)) {
+    latchExclusive(tree->latches, node->self_pointer);
+    unlatch(tree->latches, rootPointer);
+    tree->root = node->self_pointer;
+  }
+
+  for (;;) {
+    path = realloc(path, (depth + 1) * sizeof(PathEntry));
+    assert(path != NULL);
+    path[depth].page = node->self_pointer;
+    path[depth].node = node;
+    depth++;
+
+    int keyIndex = getKeyInNode(node, key_value.key, key_value.klen);
+    if (keyIndex != -1) {
+      if (replaceValue(tree, node, keyIndex, mutation) == 0) {
+        storeValue(node, keyIndex, mutation);
+        settlePath(tree, path, 0, depth - 1);
       }
-      child = nodeFromFile(tree->f, x->pointers[i]);
+      break;
+    }
+
+    if (node->header.type == LEAF) {
+      // With the key known to be missing, an update that declines splits
+      // nothing
+      if (mutationValue(mutation, NULL) == 1) {
+        insertIntoLeaf(tree, path, 0, depth - 1, mutation->result);
+      }
+      break;
+    }
+
+    uint16_t i = getNextChild(node, key_value.key, key_value.klen);
+    NodePointer latched = node->pointers[i];
+    latchExclusive(tree->latches, latched);
+    Node *child = nodeFromFile(tree->storage, latched);
+    assert(child != NULL);
+    if (shadowNode(tree, child)) {
+      latchExclusive(tree->latches, child->self_pointer);
+      unlatch(tree->latches, latched);
+      node->pointers[i] = child->self_pointer;
+      updateNodeOnFile(tree, node);
     }
-    insertNonFull(tree, child, key_value);
+    node = child;
+  }
+
+  // Bottom-up, readers can't get past the root until everything is written
+  for (int level = depth - 1; level >= 0; level--) {
+    unlatch(tree->latches, path[level].page);
+  }
+  freePath(path, depth);
+  free(path);
+
+  if (tree->shadow != NULL && shadowCommit(tree) != 1) {
+    exit(1);
   }
 }
 
-void insert(BTree *tree, KeyValue key_value) {
-  Node *root = nodeFromFile(tree->f, tree->root);
-  assert(root != NULL);
+/*
+Inserts without latching the way down. The path is read optimistically, then
+only the nodes that change are locked: the leaf, and when it has no room,
+its ancestors up to the first one that takes whatever a split below may hand
+up, which is no larger than the largest record on the way. The splits then
+go bottom-up through settlePath. When a node on the way down already holds
+the key, only that node is locked and mutated.
+Returns 1 when done, 0 when a page changed and the insert must start over,
+-1 when it has to go through insertLocked.
+*/
+static int insertOptimistic(BTree *tree, Mutation *mutation) {
+  KeyValue key_value = mutation->kv;
+  PathEntry path[OLC_MAX_DEPTH];
+  int depth = 0;
+
+  path[0].page = readRootBegin(tree, &path[0].version);
+  for (;;) {
+    PathEntry *entry = &path[depth];
+    int status = nodeFromFileOptimistic(tree, tree->storage, entry->page,
+                                        entry->version, &entry->node);
+    if (status != 1) {
+      freePath(path, depth);
+      return status;
+    }
+    depth++;
+
+    Node *node = entry->node;
+    int keyIndex = getKeyInNode(node, key_value.key, key_value.klen);
+    if (keyIndex != -1) {
+      // Still at the version read, so the copy is current and holds the key
+      if (!latchUpgrade(tree->latches, entry->page, entry->version)) {
+        freePath(path, depth);
+        return 0;
+      }
+      int done = replaceValue(tree, node, keyIndex, mutation);
+      unlatch(tree->latches, entry->page);
+      freePath(path, depth);
+      if (!done) {
+        // The node splits, which needs its ancestors latched
+        mutation->applied = 0;
+        return -1;
+      }
+      return 1;
+    }
+
+    if (node->header.type == LEAF) {
+      break;
+    }
+    if (depth == OLC_MAX_DEPTH) {
+      freePath(path, depth);
+      return -1;
+    }
 
-  if (root->header.nkeys == (2 * tree->t) - 1) {
-    Node *new_root = createNode(INTERNAL, tree->t);
-    assert(new_root != NULL);
+    path[depth].page =
+        node->pointers[getNextChild(node, key_value.key, key_value.klen)];
+    path[depth].version = latchReadBegin(tree->latches, path[depth].page);
+    if (!latchValidate(tree->latches, entry->page, entry->version)) {
+      freePath(path, depth);
+      return 0;
+    }
+  }
+
+  // The leaf is locked first, what the update makes decides the rest
+  int leaf = depth - 1;
+  if (!latchUpgrade(tree->latches, path[leaf].page, path[leaf].version)) {
+    freePath(path, depth);
+    return 0;
+  }
+  // With the key known to be missing, an update that declines splits nothing
+  if (mutationValue(mutation, NULL) != 1) {
+    unlatch(tree->latches, path[leaf].page);
+    freePath(path, depth);
+    return 1;
+  }
 
-    new_root->pointers[0] = tree->root;
+  uint64_t incoming = recordSize(mutation->result);
+  int top = leaf;
+  while (top >= 0 && !nodeTakes(tree, path[top].node, incoming)) {
+    uint64_t largest = largestRecord(path[top].node);
+    incoming = largest > incoming ? largest : incoming;
+    top--;
+  }
 
-    splitChild(tree, new_root, 0, tree->t);
-    insertNonFull(tree, new_root, key_value);
+  if (top < 0) {
+    // The root splits, which only insertLocked does
+    unlatch(tree->latches, path[leaf].page);
+    freePath(path, depth);
+    mutation->applied = 0;
+    return -1;
+  }
 
-    NodePointer newRootPointer;
-    if (addNodeToFile(tree, new_root, &newRootPointer) != 1) {
-      exit(1);
+  // The versions still match, so the copies read on the way down are current.
+  // Upgrading never waits, so taking the leaf first can't deadlock
+  for (int level = top; level < leaf; level++) {
+    if (!latchUpgrade(tree->latches, path[level].page, path[level].version)) {
+      for (int locked = top; locked < level; locked++) {
+        unlatch(tree->latches, path[locked].page);
+      }
+      unlatch(tree->latches, path[leaf].page);
+      freePath(path, depth);
+      mutation->applied = 0;
+      return 0;
     }
+  }
 
-    tree->root = newRootPointer;
-    updateTreeInFile(tree);
-  } else {
-    insertNonFull(tree, root, key_value);
+  insertIntoLeaf(tree, path, top, leaf, mutation->result);
+
+  // Bottom-up, readers can't get past the top until everything is written
+  for (int level = leaf; level >= top; level--) {
+    unlatch(tree->latches, path[level].page);
   }
+  freePath(path, depth);
+  return 1;
+}
+
+/*
+Writes one key in a single descent, leaving indexes alone, see insert and
+updateKeyValue. Whatever the update computes is decided under the latch of
+the node holding the key, or of the leaf it goes into.
+Returns mutation->applied.
+*/
+int applyMutation(BTree *tree, Mutation *mutation) {
+  mutation->replaced = 0;
+  mutation->applied = 0;
+  if (tree->shadow == NULL) {
+    for (int attempt = 0; attempt < OLC_MAX_RESTARTS; attempt++) {
+      int status = insertOptimistic(tree, mutation);
+      if (status == 1) {
+        return mutation->applied;
+      }
+      if (status == -1) {
+        break;
+      }
+    }
+  }
+
+  // Shadow paging moves every page on the path, so it always locks
+  insertLocked(tree, mutation);
+  return mutation->applied;
+}
+
+/*
+Inserts kv, or gives its key the new value when the tree already holds it.
+Indexes are left alone, see insert. previous receives a copy of the value
+replaced when there was a live one and previous is not NULL.
+Returns 1 when a live value was replaced, 0 otherwise.
+*/
+int upsertKeyValue(BTree *tree, KeyValue kv, KeyValue *previous) {
+  Mutation mutation = {.kv = kv, .previous = previous};
+  applyMutation(tree, &mutation);
+  return mutation.replaced;
+}
+
+// Goes through the indexes when the tree has any
+static void mutate(BTree *tree, Mutation *mutation) {
+  pthread_rwlock_rdlock(&tree->writeLock);
+  if (tree->indexCount == 0) {
+    applyMutation(tree, mutation);
+    pthread_rwlock_unlock(&tree->writeLock);
+    return;
+  }
+  pthread_rwlock_unlock(&tree->writeLock);
+  indexedApply(tree, mutation);
+}
+
+/*
+Inserts or overwrites key_value, keeping the tree's indexes up to date.
+Returns 1 on success, 0 when its record is past BTREE_MAX_RECORD_SIZE.
+*/
+int insert(BTree *tree, KeyValue key_value) {
+  Mutation mutation = {.kv = key_value};
+  mutate(tree, &mutation);
+  return mutation.applied;
+}
+
+/*
+Deletes the klen bytes of key by writing a tombstone over its value,
+compaction drops it for good.
+Returns 1 when a live key-value was deleted, -1 when there was none.
+*/
+int deleteKeyBytes(BTree *tree, const char *key, uint16_t klen) {
+  Mutation mutation = {.kv = {.klen = klen,
+                              .vlen = TOMBSTONE,
+                              .key = (char *)key,
+                              .value = NULL}};
+  mutate(tree, &mutation);
+  return mutation.replaced ? 1 : -1;
+}
+
+// deleteKeyBytes for a text key
+int deleteKeyValue(BTree *tree, char *key) {
+  return deleteKeyBytes(tree, key, strlen(key));
+}
+
+/*
+Atomically replaces the value of key with what update makes of it, in one
+descent. update runs with the node holding the key latched, or the leaf it
+would go into when it is missing, so no other writer can slip in between.
+Returns 1 when a value was written, 0 when update declined or the record
+would be past BTREE_MAX_RECORD_SIZE.
+*/
+int updateKeyBytes(BTree *tree, const char *key, uint16_t klen,
+                   ValueUpdate update, void *context) {
+  Mutation mutation = {.kv = {.klen = klen, .key = (char *)key},
+                       .update = update,
+                       .context = context};
+  mutate(tree, &mutation);
+  return mutation.applied;
+}
+
+// updateKeyBytes for a text key
+int updateKeyValue(BTree *tree, char *key, ValueUpdate update,
+                   void *context) {
+  return updateKeyBytes(tree, key, strlen(key), update, context);
 }
 
 int readKeyValuePairs(const char *filename, KeyValue **resultPtr) {
@@ -718,3 +1553,180 @@ int readKeyValuePairs(const char *filename, KeyValue **resultPtr) {
 
   return count;
 }
+
+/*
+Reads the node at pointer onto the path, again while writers change it.
+Nobody writes the pages of a snapshot, those are read as they are.
+*/
+static int cursorPush(Cursor *cursor, NodePointer pointer) {
+  Node *node = NULL;
+  int status;
+  if (cursor->snapshot != NULL) {
+    node = nodeFromFile(cursor->storage, pointer);
+    status = node != NULL ? 1 : -1;
+  } else {
+    do {
+      uint64_t version = latchReadBegin(cursor->tree->latches, pointer);
+      status = nodeFromFileOptimistic(cursor->tree, cursor->storage, pointer,
+                                      version, &node);
+    } while (status == 0);
+  }
+  if (status != 1) {
+    return 0;
+  }
+
+  if (cursor->depth == cursor->capacity) {
+    cursor->capacity = cursor->capacity == 0 ? 8 : cursor->capacity * 2;
+    cursor->nodes = realloc(cursor->nodes, cursor->capacity * sizeof(Node *));
+    cursor->indexes =
+        realloc(cursor->indexes, cursor->capacity * sizeof(uint16_t));
+    assert(cursor->nodes != NULL && cursor->indexes != NULL);
+  }
+
+  cursor->nodes[cursor->depth] = node;
+  cursor->indexes[cursor->depth] = 0;
+  cursor->depth++;
+  return 1;
+}
+
+// Pushes the path from pointer down to its leftmost leaf
+static int cursorDescendLeftmost(Cursor *cursor, NodePointer pointer) {
+  while (cursorPush(cursor, pointer)) {
+    Node *node = cursor->nodes[cursor->depth - 1];
+    if (node->header.type == LEAF) {
+      return 1;
+    }
+    pointer = node->pointers[0];
+  }
+  return 0;
+}
+
+Cursor *cursorOpen(BTree *tree) { return cursorSeek(tree, "", 0); }
+
+/*
+Opens a cursor at the first key-value whose key is not below key. With shadow
+paging it reads a snapshot, pages written in place are only safe that way.
+*/
+Cursor *cursorSeek(BTree *tree, const char *key, uint16_t klen) {
+  Cursor *cursor = calloc(1, sizeof(Cursor));
+  if (cursor == NULL) {
+    perror("Memory allocation failed");
+    return NULL;
+  }
+  cursor->tree = tree;
+
+  NodePointer pointer;
+  if (tree->shadow != NULL) {
+    cursor->snapshot = malloc(sizeof(Snapshot));
+    assert(cursor->snapshot != NULL);
+    while (snapshotAcquire(tree, cursor->snapshot) != 1) {
+      sched_yield();
+    }
+    pointer = cursor->snapshot->root;
+    cursor->storage = cursor->snapshot->storage;
+  } else {
+    pointer = readRootStorage(tree, &cursor->storage);
+  }
+  while (cursorPush(cursor, pointer)) {
+    int top = cursor->depth - 1;
+    Node *node = cursor->nodes[top];
+    uint16_t i = 0;
+    while (i < node->header.nkeys &&
+           compareKeyBytes(key, klen, node->key_values[i]) > 0) {
+      i++;
+    }
+    // Keys before i and everything left of pointers[i] are smaller
+    cursor->indexes[top] = i;
+    if (node->header.type == LEAF) {
+      return cursor;
+    }
+    pointer = node->pointers[i];
+  }
+
+  cursorClose(cursor);
+  return NULL;
+}
+
+/*
+Yields the next key-value in key order. The key and value point into the
+cursor's nodes and are only valid until the next call. Deleted key-values
+are skipped.
+Returns 1 when a key-value was produced, 0 at the end of the tree and -1 on a
+read error.
+*/
+int cursorNext(Cursor *cursor, KeyValue *kv) {
+  while (cursor->depth > 0) {
+    int top = cursor->depth - 1;
+    Node *node = cursor->nodes[top];
+    uint16_t index = cursor->indexes[top];
+
+    if (index < node->header.nkeys) {
+      KeyValue current = node->key_values[index];
+      cursor->indexes[top] = index + 1;
+      if (node->header.type != LEAF &&
+          cursorDescendLeftmost(cursor, node->pointers[index + 1]) != 1) {
+        return -1;
+      }
+      // Deleted key-values stay in the tree until it is compacted
+      if (isTombstone(current)) {
+        continue;
+      }
+      *kv = current;
+      return 1;
+    }
+
+    freeNode(node);
+    cursor->depth--;
+  }
+  return 0;
+}
+
+void cursorClose(Cursor *cursor) {
+  if (cursor == NULL) {
+    return;
+  }
+  for (int i = 0; i < cursor->depth; i++) {
+    freeNode(cursor->nodes[i]);
+  }
+  if (cursor->snapshot != NULL) {
+    snapshotRelease(cursor->tree, cursor->snapshot);
+    free(cursor->snapshot);
+  }
+  free(cursor->nodes);
+  free(cursor->indexes);
+  free(cursor);
+}
+
+/*
+Calls visit for the live key-values whose key starts with prefix, in key
+order, until limit of them were visited (0 for no limit) or visit returns 0.
+A cursor seeks the first key not below prefix and the scan stops at the
+first key past it. Key-values point into the cursor's nodes, they are only
+valid during the call. Like any cursor, the scan doesn't wait for writers
+but may miss keys they move meanwhile.
+Returns how many key-values were visited, -1 on a read error.
+*/
+int prefixScan(BTree *tree, const char *prefix, uint16_t plen, int limit,
+               KeyValueVisitor visit, void *context) {
+  Cursor *cursor = cursorSeek(tree, prefix, plen);
+  if (cursor == NULL) {
+    return -1;
+  }
+
+  int visited = 0;
+  int status = 0;
+  KeyValue kv;
+  while ((limit == 0 || visited < limit) &&
+         (status = cursorNext(cursor, &kv)) == 1) {
+    if (kv.klen < plen || memcmp(kv.key, prefix, plen) != 0) {
+      break;
+    }
+    visited++;
+    if (visit(context, &kv) != 1) {
+      break;
+    }
+  }
+
+  cursorClose(cursor);
+  return status == -1 ? -1 : visited;
+}
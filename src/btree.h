@@ -1,9 +1,30 @@
 #ifndef BTREE_H
 #define BTREE_H
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 
+#define BTREE_PAGE_SIZE                                                        \
+  4096 // TODO: change this to the actual disk page size (look it up)
+#define BTREE_MAX_KEY_SIZE 1000
+#define BTREE_MAX_VAL_SIZE 3000
+// Largest record a node takes, a key and a value at their limits
+#define BTREE_MAX_RECORD_SIZE (4 + BTREE_MAX_KEY_SIZE + BTREE_MAX_VAL_SIZE)
+#define BTREE_DEFAULT_T 4
+
+#define TREE_MAGIC "KVDBTREE"
+#define TREE_MAGIC_SIZE 8
+#define TREE_VERSION 6
+#define TREE_HEADER_SIZE 104
+#define TREE_MAX_INDEXES 4
+
+#define TREE_SHADOW_PAGING 0x0001 // Header flag, pages are copied on write
+#define TREE_KNOWN_FLAGS TREE_SHADOW_PAGING
+
+#define TOMBSTONE 0xFFFF // vlen of a deleted key-value, it has no value bytes
+
 typedef enum nodeType { INTERNAL, LEAF, DELETED } nodeType;
 
 typedef struct NodeHeader {
@@ -28,8 +49,10 @@ typedef struct KeyValue {
 } KeyValue;
 
 /*
-| type | nkeys |  pointers        |   offsets  | key-values
-|  2B  |   2B  | (nkeys + 1) * 8B | nkeys * 2B | ...
+| type | nkeys |  pointers        |   offsets  | free | key-values |
+|  2B  |   2B  | (nkeys + 1) * 8B | nkeys * 2B |  ... | ...        |
+Offsets are positions in the page. The key-values end at the end of the page
+and new ones go below them, so adding one moves none of the others.
 */
 typedef struct Node {
   struct NodeHeader header;
@@ -39,24 +62,139 @@ typedef struct Node {
   KeyValue *key_values;
 } Node;
 
-// TODO: Create destroyer
+struct ShadowState;
+struct LatchTable;
+struct Storage;
+struct Warmup;
+
+/*
+A tree handle can be shared by threads: pages are read and written with
+positioned I/O through its storage, and every page has a version latch.
+Lookups and most inserts descend without locking and validate the versions
+they saw, writers only lock the pages they modify.
+*/
 typedef struct BTree {
-  NodePointer root;
-  NodePointer last;
-  FILE *f;
+  _Atomic NodePointer root;
+  _Atomic NodePointer last;
+  _Atomic(struct Storage *) storage;
+  struct Storage **retiredStorages; // Replaced, kept open for readers
+  int retiredCount;
+  int locked; // flock operation held on the file, 0 for none
   uint16_t t;
+  uint64_t generation; // Bumped by every shadow paging commit
+  NodePointer hotPages; // Page listing the hottest pages at the last close
+  uint16_t flags;       // TREE_SHADOW_PAGING
+  NodePointer freeList; // Free pages saved by the last close, 0 for none
+  char *filename;
+  struct ShadowState *shadow; // NULL unless copy-on-write is enabled
+  struct LatchTable *latches;
+  struct Warmup *warmup; // Background prefetch started by the open
+  pthread_mutex_t headerLock;
+
+  // Secondary indexes on the values, trees sharing this one's pages
+  uint16_t indexCount;
+  uint16_t indexPrefixes[TREE_MAX_INDEXES]; // Value bytes indexed, 0 for all
+  NodePointer indexRoots[TREE_MAX_INDEXES]; // As last read from the header
+  struct BTree *indexes[TREE_MAX_INDEXES];
+  struct BTree *owner; // Tree an index belongs to, NULL for the others
+
+  // Shared by writers, held exclusively by writers of indexed trees and by
+  // compaction, which must see no writer at all
+  pthread_rwlock_t writeLock;
 } BTree;
 
+/*
+In-order iterator over the key-values of a tree. Keeps the path from the root
+to the current node as a stack, so only one node per level is kept in memory.
+*/
+typedef struct Cursor {
+  BTree *tree;
+  struct Storage *storage;   // Where the tree was when the cursor opened
+  struct Snapshot *snapshot; // Pinned with shadow paging, NULL otherwise
+  Node **nodes;              // Nodes on the current path, root first
+  uint16_t *indexes;         // Next key to yield in each node
+  int depth;
+  int capacity;
+} Cursor;
+
+/*
+Computes the value of a key from its current one, current is NULL when the
+key is missing or deleted. Returns 1 with updated's value and vlen set to
+write them, 0 to leave the key alone. It runs with the node holding the key
+latched, so it must not touch the tree.
+*/
+typedef int (*ValueUpdate)(void *context, const KeyValue *current,
+                           KeyValue *updated);
+
+/*
+Receives the key-values of a scan, which point into pages the scan owns.
+Returns 1 to go on, 0 to stop the scan.
+*/
+typedef int (*KeyValueVisitor)(void *context, const KeyValue *kv);
+
+// A write of one key, kv's value or whatever update makes of the current one
+typedef struct Mutation {
+  KeyValue kv; // Key, and the value written when update is NULL
+  ValueUpdate update;
+  void *context;
+  KeyValue *previous; // Receives a copy of a live value replaced, or NULL
+  KeyValue result;    // What was written, the value belongs to the caller
+  int replaced;       // A live value was replaced
+  int applied;        // Anything was written, update may decline
+} Mutation;
+
 Node *nodeFromBytes(unsigned char *bytes);
-Node *nodeFromFile(FILE *db, uint64_t offset);
+Node *nodeFromFile(struct Storage *storage, NodePointer offset);
 BTree *treeFromFileName(char *filename);
+BTree *treeFromStorage(struct Storage *storage, char *filename);
 int searchKeyValue(BTree *tree, char *key, KeyValue *foundKv);
+int searchKeyBytes(BTree *tree, const char *key, uint16_t klen,
+                   KeyValue *foundKv);
 
+BTree *createTree(char *filename);
+BTree *createTreeOn(struct Storage *storage, char *filename);
+void closeTree(BTree *tree);
+int reloadTreeHeader(BTree *tree);
+int lockTree(BTree *tree, int operation);
+void unlockTree(BTree *tree);
+void replaceStorage(BTree *tree, struct Storage *storage, NodePointer root);
 BTree *createMockupTree();
-void insert(BTree *tree, KeyValue key_value);
+int insert(BTree *tree, KeyValue key_value);
+int upsertKeyValue(BTree *tree, KeyValue kv, KeyValue *previous);
+int applyMutation(BTree *tree, Mutation *mutation);
+int updateKeyValue(BTree *tree, char *key, ValueUpdate update, void *context);
+int updateKeyBytes(BTree *tree, const char *key, uint16_t klen,
+                   ValueUpdate update, void *context);
+int deleteKeyValue(BTree *tree, char *key);
+int deleteKeyBytes(BTree *tree, const char *key, uint16_t klen);
+int isTombstone(KeyValue kv);
 void printTree(BTree *tree);
 void printKeyValues(KeyValue *keyvalues, uint16_t nkeys);
 int readKeyValuePairs(const char *filename, KeyValue **resultPtr);
 void printKeyValue(KeyValue keyvalue);
 
+Node *createNode(int type, int t);
+void freeNode(Node *node);
+void recalculateOffsets(Node *node);
+uint16_t recordSize(KeyValue kv);
+int nodeTakes(BTree *tree, Node *node, uint64_t size);
+int compareKeyBytes(const char *key, uint16_t klen, KeyValue kv);
+NodePointer allocatePage(BTree *tree);
+int addNodeToFile(BTree *tree, Node *node, NodePointer *destinationPointer);
+int updateNodeOnFile(BTree *tree, Node *node);
+void updateTreeInFile(BTree *tree);
+int initTreeLatches(BTree *tree);
+void destroyTreeLatches(BTree *tree);
+void treeHeaderToBytes(BTree *tree, unsigned char *bytes);
+int treeHeaderFromBytes(BTree *tree, unsigned char *bytes);
+int getKeyInNode(Node *node, const char *key, uint16_t klen);
+uint16_t getNextChild(Node *currentNode, const char *key, uint16_t klen);
+
+Cursor *cursorOpen(BTree *tree);
+Cursor *cursorSeek(BTree *tree, const char *key, uint16_t klen);
+int cursorNext(Cursor *cursor, KeyValue *kv);
+void cursorClose(Cursor *cursor);
+int prefixScan(BTree *tree, const char *prefix, uint16_t plen, int limit,
+               KeyValueVisitor visit, void *context);
+
 #endif // BTREE_H
@@ -0,0 +1,398 @@
+#include "bulkload.h"
+#include "btree.h"
+#include "secondary.h"
+#include "shadow.h"
+#include "storage.h"
+#include "warmup.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+static BulkLoader *bulkLoaderNew(BTree *tree) {
+  BulkLoader *loader = calloc(1, sizeof(BulkLoader));
+  if (loader == NULL) {
+    perror("Memory allocation failed");
+    return NULL;
+  }
+  loader->tree = tree;
+  return loader;
+}
+
+static void bulkEnsureLevel(BulkLoader *loader, int level) {
+  if (level < loader->height) {
+    return;
+  }
+
+  loader->levels =
+      realloc(loader->levels, (level + 1) * sizeof(BulkLevel));
+  assert(loader->levels != NULL);
+
+  BulkLevel *newLevel = &loader->levels[level];
+  newLevel->current = createNode(level == 0 ? LEAF : INTERNAL, loader->tree->t);
+  newLevel->previous = NULL;
+  newLevel->written = 0;
+  loader->height = level + 1;
+}
+
+static int bulkFlush(BulkLoader *loader, int level, Node *node,
+                     NodePointer *pointer) {
+  BulkLevel *bulkLevel = &loader->levels[level];
+
+  if (loader->dry) {
+    *pointer = 0;
+  } else if (loader->levelStart != NULL) {
+    // Levels are laid out root first, each ends where the one below starts
+    if (level >= loader->plannedHeight ||
+        loader->levelStart[level] + bulkLevel->written * BTREE_PAGE_SIZE >=
+            (level == 0 ? loader->end : loader->levelStart[level - 1])) {
+      printf("Bulk load does not match the planned layout\n");
+      return 0;
+    }
+    recalculateOffsets(node);
+    node->self_pointer =
+        loader->levelStart[level] + bulkLevel->written * BTREE_PAGE_SIZE;
+    if (updateNodeOnFile(loader->tree, node) != 1) {
+      return 0;
+    }
+    *pointer = node->self_pointer;
+  } else {
+    recalculateOffsets(node);
+    if (addNodeToFile(loader->tree, node, pointer) != 1) {
+      return 0;
+    }
+  }
+
+  bulkLevel->written++;
+  freeNode(node);
+  return 1;
+}
+
+static void bulkAddChild(BulkLoader *loader, int level, NodePointer pointer) {
+  bulkEnsureLevel(loader, level);
+  Node *node = loader->levels[level].current;
+  node->pointers[node->header.nkeys] = pointer;
+}
+
+static int bulkPush(BulkLoader *loader, int level, KeyValue kv);
+
+// Writes the held back node and hands it and its separator to the parent
+static int bulkCommit(BulkLoader *loader, int level) {
+  BulkLevel *bulkLevel = &loader->levels[level];
+  Node *previous = bulkLevel->previous;
+  KeyValue separator = bulkLevel->pending;
+  bulkLevel->previous = NULL;
+
+  NodePointer pointer;
+  if (bulkFlush(loader, level, previous, &pointer) != 1) {
+    return 0;
+  }
+  bulkAddChild(loader, level + 1, pointer);
+  return bulkPush(loader, level + 1, separator);
+}
+
+static int bulkPush(BulkLoader *loader, int level, KeyValue kv) {
+  bulkEnsureLevel(loader, level);
+  BulkLevel *bulkLevel = &loader->levels[level];
+  Node *node = bulkLevel->current;
+
+  if (!nodeTakes(loader->tree, node, recordSize(kv))) {
+    // Full, kv separates this node from the next one
+    bulkLevel->previous = node;
+    bulkLevel->pending = kv;
+    bulkLevel->current = createNode(node->header.type, loader->tree->t);
+    return 1;
+  }
+
+  if (node->header.nkeys == 0 && bulkLevel->previous != NULL) {
+    if (bulkCommit(loader, level) != 1) {
+      return 0;
+    }
+  }
+
+  node->key_values[node->header.nkeys] = kv;
+  node->header.nkeys++;
+  return 1;
+}
+
+/*
+Plans the layout by running the same algorithm over records of the given
+lengths. Nodes close by bytes, so a record with no bytes of its own but
+lengths[i] of key stands in for the real one.
+*/
+static int bulkPlan(BulkLoader *loader, const uint16_t *lengths) {
+  BulkLoader *dry = bulkLoaderNew(loader->tree);
+  if (dry == NULL) {
+    return 0;
+  }
+  dry->dry = 1;
+
+  for (uint64_t i = 0; i < loader->expectedKeys; i++) {
+    KeyValue record = {
+        .klen = lengths[i], .vlen = 0, .key = NULL, .value = NULL};
+    bulkPush(dry, 0, record);
+  }
+  bulkLoaderFinish(dry);
+
+  loader->plannedHeight = dry->height;
+  loader->levelStart = malloc(dry->height * sizeof(NodePointer));
+  assert(loader->levelStart != NULL);
+
+  // Root level first, leaves last
+  NodePointer page = BTREE_PAGE_SIZE;
+  for (int level = dry->height - 1; level >= 0; level--) {
+    loader->levelStart[level] = page;
+    page += dry->levels[level].written * BTREE_PAGE_SIZE;
+  }
+  loader->end = page;
+
+  bulkLoaderFree(dry);
+  return 1;
+}
+
+/*
+Creates a loader appending to the tree's file, or when lengths is not NULL
+one that plans the layout for expectedKeys records, the ith with lengths[i]
+bytes of key and value. The planned loader then takes exactly those.
+*/
+BulkLoader *bulkLoaderCreate(BTree *tree, const uint16_t *lengths,
+                             uint64_t expectedKeys) {
+  BulkLoader *loader = bulkLoaderNew(tree);
+  if (loader == NULL) {
+    return NULL;
+  }
+  if (lengths == NULL) {
+    return loader;
+  }
+  loader->expectedKeys = expectedKeys;
+
+  if (expectedKeys > 0 && bulkPlan(loader, lengths) != 1) {
+    bulkLoaderFree(loader);
+    return NULL;
+  }
+  return loader;
+}
+
+/*
+Adds the next key-value. Keys must be unique and given in ascending order,
+the key and value are copied.
+*/
+int bulkLoaderAdd(BulkLoader *loader, KeyValue kv) {
+  if (loader->count > 0 &&
+      compareKeyBytes(kv.key, kv.klen, loader->last) <= 0) {
+    printf("Bulk load keys are not sorted and unique\n");
+    return 0;
+  }
+
+  KeyValue copy;
+  copy.klen = kv.klen;
+  copy.vlen = kv.vlen;
+  copy.key = malloc(kv.klen);
+  copy.value = malloc(kv.vlen);
+  assert(copy.key != NULL && copy.value != NULL);
+  memcpy(copy.key, kv.key, kv.klen);
+  memcpy(copy.value, kv.value, kv.vlen);
+
+  loader->last.key = realloc(loader->last.key, kv.klen);
+  memcpy(loader->last.key, kv.key, kv.klen);
+  loader->last.klen = kv.klen;
+
+  loader->count++;
+  return bulkPush(loader, 0, copy);
+}
+
+/*
+Writes the remaining nodes and points the tree at the new root.
+*/
+int bulkLoaderFinish(BulkLoader *loader) {
+  if (loader->levelStart != NULL && loader->count != loader->expectedKeys) {
+    printf("Bulk load got %lu keys, expected %lu\n", loader->count,
+           loader->expectedKeys);
+    return 0;
+  }
+
+  bulkEnsureLevel(loader, 0);
+
+  NodePointer pointer = 0;
+  for (int level = 0; level < loader->height; level++) {
+    BulkLevel *bulkLevel = &loader->levels[level];
+    Node *current = bulkLevel->current;
+    Node *previous = bulkLevel->previous;
+
+    if (previous != NULL && current->header.nkeys == 0) {
+      // Borrow the last key of the held back node so no node ends up empty
+      if (current->header.type == INTERNAL) {
+        current->pointers[1] = current->pointers[0];
+        current->pointers[0] = previous->pointers[previous->header.nkeys];
+      }
+      current->key_values[0] = bulkLevel->pending;
+      current->header.nkeys = 1;
+      bulkLevel->pending = previous->key_values[previous->header.nkeys - 1];
+      previous->header.nkeys--;
+    }
+
+    if (previous != NULL && bulkCommit(loader, level) != 1) {
+      return 0;
+    }
+
+    bulkLevel = &loader->levels[level];
+    bulkLevel->current = NULL;
+    if (bulkFlush(loader, level, current, &pointer) != 1) {
+      return 0;
+    }
+    if (level < loader->height - 1) {
+      bulkAddChild(loader, level + 1, pointer);
+    }
+  }
+
+  if (loader->dry) {
+    return 1;
+  }
+
+  loader->tree->root = pointer;
+  if (loader->levelStart != NULL) {
+    loader->tree->last = loader->end;
+  }
+  updateTreeInFile(loader->tree);
+  return 1;
+}
+
+void bulkLoaderFree(BulkLoader *loader) {
+  if (loader == NULL) {
+    return;
+  }
+  for (int level = 0; level < loader->height; level++) {
+    freeNode(loader->levels[level].current);
+    freeNode(loader->levels[level].previous);
+  }
+  free(loader->levels);
+  free(loader->levelStart);
+  free(loader->last.key);
+  free(loader);
+}
+
+static int compactFile(BTree *tree) {
+  uint64_t count = 0;
+  uint64_t capacity = 0;
+  uint16_t *lengths = NULL;
+  KeyValue kv;
+
+  // The layout is planned from the sizes of the live records
+  Cursor *cursor = cursorOpen(tree);
+  if (cursor == NULL) {
+    return 0;
+  }
+  while (cursorNext(cursor, &kv) == 1) {
+    if (count == capacity) {
+      capacity = capacity == 0 ? 1024 : capacity * 2;
+      lengths = realloc(lengths, capacity * sizeof(uint16_t));
+      assert(lengths != NULL);
+    }
+    lengths[count++] = kv.klen + kv.vlen;
+  }
+  cursorClose(cursor);
+
+  // In-memory trees are simply replaced by a new in-memory storage
+  StorageKind kind = tree->storage->kind;
+  char *compactName = NULL;
+  if (kind != STORAGE_MEMORY) {
+    size_t nameLength = strlen(tree->filename) + strlen(".compact") + 1;
+    compactName = malloc(nameLength);
+    snprintf(compactName, nameLength, "%s.compact", tree->filename);
+  }
+
+  Storage *storage = storageOpen(compactName, kind, 1);
+  if (storage == NULL) {
+    if (compactName != NULL) {
+      unlink(compactName);
+    }
+    free(compactName);
+    free(lengths);
+    return 0;
+  }
+
+  BTree target = {.root = BTREE_PAGE_SIZE,
+                  .last = BTREE_PAGE_SIZE,
+                  .storage = storage,
+                  .t = tree->t,
+                  .generation = tree->generation + 1,
+                  .flags = tree->flags,
+                  .filename = compactName};
+  initTreeLatches(&target);
+
+  BulkLoader *loader = bulkLoaderCreate(&target, lengths, count);
+  free(lengths);
+  cursor = cursorOpen(tree);
+  int ok = loader != NULL && cursor != NULL;
+  int status;
+  while (ok && (status = cursorNext(cursor, &kv)) != 0) {
+    ok = status == 1 && bulkLoaderAdd(loader, kv) == 1;
+  }
+  ok = ok && bulkLoaderFinish(loader) == 1;
+  cursorClose(cursor);
+  bulkLoaderFree(loader);
+
+  // The indexes are in the new file before it replaces the old one, a crash
+  // leaves either file whole with its indexes
+  ok = ok && rebuildIndexes(tree, &target) == 1;
+  closeIndexes(&target);
+  destroyTreeLatches(&target);
+
+  ok = ok && storageSync(storage) == 1;
+  // Other processes find the new file locked the way the old one was
+  ok = ok && (tree->locked == 0 || storageLock(storage, tree->locked) == 1);
+  if (!ok ||
+      (compactName != NULL && rename(compactName, tree->filename) != 0)) {
+    printf("Compaction failed\n");
+    storageClose(storage);
+    if (compactName != NULL) {
+      unlink(compactName);
+    }
+    free(compactName);
+    return 0;
+  }
+
+  // The warm-up reads the old storage, and its hot pages mean nothing now
+  finishWarmup(tree->warmup);
+  tree->warmup = NULL;
+  Storage *old = tree->storage;
+  replaceStorage(tree, storage, target.root);
+  tree->last = target.last;
+  tree->generation = target.generation;
+  tree->hotPages = 0;
+  memcpy(tree->indexRoots, target.indexRoots, sizeof(tree->indexRoots));
+  openIndexes(tree);
+  free(compactName);
+
+  // Processes waiting for the old file move on to the new one
+  if (tree->locked != 0) {
+    storageLock(old, LOCK_UN);
+  }
+  return 1;
+}
+
+/*
+Rewrites the live key-values of the tree into a new file in key order, with
+every node full, and atomically replaces the old file with it. Writers of
+this process wait for the copy and the swap, lookups go on, those that
+started before the swap finish on the old file. When the caller holds the
+file's flock, the new file is locked the same way before it replaces the
+old one, and lockTree moves other processes over to it. A shared flock
+keeps the writers of other processes out, compactions of several processes
+must take turns some other way.
+*/
+int compactTree(BTree *tree) {
+  pthread_rwlock_wrlock(&tree->writeLock);
+  if (tree->shadow != NULL) {
+    shadowBegin(tree);
+  }
+  int result = compactFile(tree);
+  if (tree->shadow != NULL) {
+    shadowReset(tree);
+  }
+  pthread_rwlock_unlock(&tree->writeLock);
+  return result;
+}
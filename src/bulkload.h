@@ -0,0 +1,46 @@
+#ifndef BULKLOAD_H
+#define BULKLOAD_H
+
+#include "btree.h"
+
+/*
+One level of a tree being built bottom-up. A completed node is held back in
+`previous` until `current` receives its first key, so the right edge of the
+tree can borrow from it instead of ending with an empty node.
+*/
+typedef struct BulkLevel {
+  Node *current;
+  Node *previous;
+  KeyValue pending; // Separator between previous and current
+  uint64_t written; // Nodes flushed at this level
+} BulkLevel;
+
+/*
+Builds a tree from key-values given in ascending key order, filling every
+node until the next record doesn't fit its bytes or keys. When the sizes of
+the records are known up front, the layout is planned so the internal levels
+are clustered at the front of the file, root first, followed by the leaves in
+key order.
+*/
+typedef struct BulkLoader {
+  BTree *tree;
+  BulkLevel *levels;
+  int height;
+  NodePointer *levelStart; // Planned first page of each level, NULL to append
+  int plannedHeight;
+  NodePointer end;
+  uint64_t count;
+  uint64_t expectedKeys;
+  KeyValue last;
+  int dry; // Only count nodes, used to plan the layout
+} BulkLoader;
+
+BulkLoader *bulkLoaderCreate(BTree *tree, const uint16_t *lengths,
+                             uint64_t expectedKeys);
+int bulkLoaderAdd(BulkLoader *loader, KeyValue kv);
+int bulkLoaderFinish(BulkLoader *loader);
+void bulkLoaderFree(BulkLoader *loader);
+
+int compactTree(BTree *tree);
+
+#endif // BULKLOAD_H
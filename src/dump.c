@@ -0,0 +1,619 @@
+#define _GNU_SOURCE
+#include "dump.h"
+#include "btree.h"
+#include "bulkload.h"
+#include "storage.h"
+#include "utils.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+typedef int (*ImportConsumer)(void *context, KeyValue kv);
+
+static void ensureChunkCapacity(ImportChunk *chunk, size_t capacity) {
+  if (chunk->capacity >= capacity) {
+    return;
+  }
+  chunk->capacity = capacity > chunk->capacity * 2 ? capacity
+                                                   : chunk->capacity * 2;
+  chunk->data = realloc(chunk->data, chunk->capacity);
+  assert(chunk->data != NULL);
+}
+
+static void addRecord(ImportChunk *chunk, KeyValue kv) {
+  if (chunk->count == chunk->recordCapacity) {
+    chunk->recordCapacity =
+        chunk->recordCapacity == 0 ? 4096 : chunk->recordCapacity * 2;
+    chunk->records =
+        realloc(chunk->records, chunk->recordCapacity * sizeof(KeyValue));
+    assert(chunk->records != NULL);
+  }
+  chunk->records[chunk->count++] = kv;
+}
+
+// Returns where the last complete record in data ends
+static size_t findBoundary(DumpFormat format, char *data, size_t length,
+                           int eof) {
+  if (format == DUMP_TEXT) {
+    if (eof) {
+      return length; // The last line may not end with a newline
+    }
+    char *newline = memrchr(data, '\n', length);
+    return newline == NULL ? 0 : (size_t)(newline - data) + 1;
+  }
+
+  size_t position = 0;
+  while (position + KEYVALUE_HEADER <= length) {
+    uint16_t klen = bytesToUInt16((unsigned char *)data, position);
+    uint16_t vlen = bytesToUInt16((unsigned char *)data, position + 2);
+    if (position + KEYVALUE_HEADER + klen + vlen > length) {
+      break;
+    }
+    position += KEYVALUE_HEADER + klen + vlen;
+  }
+  return position;
+}
+
+static const char *checkRecord(KeyValue kv) {
+  if (kv.klen == 0) {
+    return "empty key";
+  }
+  if (kv.klen > BTREE_MAX_KEY_SIZE) {
+    return "key too long";
+  }
+  if (kv.vlen > BTREE_MAX_VAL_SIZE) {
+    return "value too long";
+  }
+  return NULL;
+}
+
+static void parseTextChunk(ImportChunk *chunk) {
+  char *position = chunk->data;
+  char *end = chunk->data + chunk->length;
+
+  while (position < end && chunk->error == NULL) {
+    char *newline = memchr(position, '\n', end - position);
+    char *lineEnd = newline == NULL ? end : newline;
+    char *next = newline == NULL ? end : newline + 1;
+
+    if (lineEnd > position && lineEnd[-1] == '\r') {
+      lineEnd--;
+    }
+    if (lineEnd == position) {
+      position = next;
+      continue;
+    }
+
+    // Only the first separator counts, values may contain ':'
+    char *separator = memchr(position, ':', lineEnd - position);
+    if (separator == NULL) {
+      chunk->error = "line without a ':' separator";
+      return;
+    }
+
+    KeyValue kv = {.klen = separator - position,
+                   .vlen = lineEnd - separator - 1,
+                   .key = position,
+                   .value = separator + 1};
+    if (separator - position > UINT16_MAX ||
+        lineEnd - separator - 1 > UINT16_MAX) {
+      chunk->error = "record too long";
+      return;
+    }
+    chunk->error = checkRecord(kv);
+    addRecord(chunk, kv);
+    position = next;
+  }
+}
+
+static void parseBinaryChunk(ImportChunk *chunk) {
+  unsigned char *bytes = (unsigned char *)chunk->data;
+  size_t position = 0;
+
+  while (position < chunk->length && chunk->error == NULL) {
+    KeyValue kv;
+    kv.klen = bytesToUInt16(bytes, position);
+    kv.vlen = bytesToUInt16(bytes, position + 2);
+    kv.key = chunk->data + position + KEYVALUE_HEADER;
+    kv.value = kv.key + kv.klen;
+
+    chunk->error = checkRecord(kv);
+    addRecord(chunk, kv);
+    position += KEYVALUE_HEADER + kv.klen + kv.vlen;
+  }
+}
+
+/*
+Reads the next slice of the input into chunk, cut on a record boundary. The
+incomplete record at the end is carried over to the next chunk.
+Returns 1 at the end of the input, 0 when there is more and -1 on error.
+*/
+static int fillChunk(Importer *importer, ImportChunk *chunk) {
+  chunk->length = 0;
+  chunk->count = 0;
+  chunk->error = NULL;
+
+  ensureChunkCapacity(chunk, importer->carryLength + IMPORT_CHUNK_SIZE);
+  memcpy(chunk->data, importer->carry, importer->carryLength);
+  chunk->length = importer->carryLength;
+  importer->carryLength = 0;
+
+  int eof = 0;
+  size_t boundary;
+  for (;;) {
+    ensureChunkCapacity(chunk, chunk->length + IMPORT_CHUNK_SIZE);
+    size_t n = fread(chunk->data + chunk->length, 1, IMPORT_CHUNK_SIZE,
+                     importer->input);
+    chunk->length += n;
+    if (n < IMPORT_CHUNK_SIZE) {
+      if (ferror(importer->input)) {
+        perror("Failed to read the import file");
+        return -1;
+      }
+      eof = 1;
+    }
+
+    // A record longer than a chunk makes it grow until the record fits
+    boundary = findBoundary(importer->format, chunk->data, chunk->length, eof);
+    if (boundary > 0 || eof) {
+      break;
+    }
+  }
+
+  if (eof && boundary < chunk->length) {
+    printf("Truncated record at the end of the dump\n");
+    return -1;
+  }
+
+  size_t rest = chunk->length - boundary;
+  if (rest > importer->carryCapacity) {
+    importer->carryCapacity = rest;
+    importer->carry = realloc(importer->carry, rest);
+    assert(importer->carry != NULL);
+  }
+  memcpy(importer->carry, chunk->data + boundary, rest);
+  importer->carryLength = rest;
+  chunk->length = boundary;
+
+  return eof;
+}
+
+static void *importReader(void *arg) {
+  Importer *importer = arg;
+
+  for (;;) {
+    pthread_mutex_lock(&importer->lock);
+    ImportChunk *chunk =
+        &importer->chunks[importer->nextFill % importer->nchunks];
+    while (!importer->failed && chunk->state != CHUNK_EMPTY) {
+      pthread_cond_wait(&importer->changed, &importer->lock);
+    }
+    if (importer->failed) {
+      pthread_mutex_unlock(&importer->lock);
+      return NULL;
+    }
+    pthread_mutex_unlock(&importer->lock);
+
+    int eof = fillChunk(importer, chunk);
+
+    pthread_mutex_lock(&importer->lock);
+    if (eof < 0) {
+      importer->failed = 1;
+    } else {
+      chunk->sequence = importer->nextFill++;
+      chunk->state = CHUNK_FILLED;
+      if (eof) {
+        importer->eof = 1;
+        importer->totalChunks = importer->nextFill;
+      }
+    }
+    pthread_cond_broadcast(&importer->changed);
+    pthread_mutex_unlock(&importer->lock);
+
+    if (eof != 0) {
+      return NULL;
+    }
+  }
+}
+
+static void *importWorker(void *arg) {
+  Importer *importer = arg;
+
+  for (;;) {
+    pthread_mutex_lock(&importer->lock);
+    ImportChunk *chunk;
+    for (;;) {
+      if (importer->failed ||
+          (importer->eof && importer->nextParse >= importer->totalChunks)) {
+        pthread_mutex_unlock(&importer->lock);
+        return NULL;
+      }
+      chunk = &importer->chunks[importer->nextParse % importer->nchunks];
+      if (chunk->state == CHUNK_FILLED &&
+          chunk->sequence == importer->nextParse) {
+        break;
+      }
+      pthread_cond_wait(&importer->changed, &importer->lock);
+    }
+    importer->nextParse++;
+    chunk->state = CHUNK_PARSING;
+    pthread_mutex_unlock(&importer->lock);
+
+    if (importer->format == DUMP_TEXT) {
+      parseTextChunk(chunk);
+    } else {
+      parseBinaryChunk(chunk);
+    }
+
+    pthread_mutex_lock(&importer->lock);
+    chunk->state = CHUNK_PARSED;
+    pthread_cond_broadcast(&importer->changed);
+    pthread_mutex_unlock(&importer->lock);
+  }
+}
+
+/*
+Reads the key and value lengths of the expectedKeys records of a binary
+dump, so the bulk loader can plan for them, and goes back to the first
+record. A dump that doesn't hold that many valid records gets no lengths,
+parsing it reports what is wrong.
+*/
+static void readRecordLengths(Importer *importer) {
+  importer->lengths = malloc(importer->expectedKeys * sizeof(uint16_t));
+  if (importer->lengths == NULL) {
+    return;
+  }
+
+  unsigned char header[KEYVALUE_HEADER];
+  uint64_t i = 0;
+  while (i < importer->expectedKeys &&
+         fread(header, 1, KEYVALUE_HEADER, importer->input) ==
+             KEYVALUE_HEADER) {
+    uint16_t klen = bytesToUInt16(header, 0);
+    uint16_t vlen = bytesToUInt16(header, 2);
+    if (klen > BTREE_MAX_KEY_SIZE || vlen > BTREE_MAX_VAL_SIZE ||
+        fseek(importer->input, klen + vlen, SEEK_CUR) != 0) {
+      break;
+    }
+    importer->lengths[i++] = klen + vlen;
+  }
+
+  if (i < importer->expectedKeys) {
+    free(importer->lengths);
+    importer->lengths = NULL;
+  }
+  fseek(importer->input, DUMP_HEADER_SIZE, SEEK_SET);
+}
+
+static int importerOpen(Importer *importer, const char *filename) {
+  memset(importer, 0, sizeof(Importer));
+
+  importer->input = fopen(filename, "rb");
+  if (importer->input == NULL) {
+    perror("Failed to open the import file");
+    return 0;
+  }
+
+  unsigned char header[DUMP_HEADER_SIZE];
+  size_t n = fread(header, 1, DUMP_HEADER_SIZE, importer->input);
+  if (n == DUMP_HEADER_SIZE &&
+      memcmp(header, DUMP_MAGIC, DUMP_MAGIC_SIZE) == 0) {
+    if (bytesToUInt16(header, DUMP_MAGIC_SIZE) != DUMP_VERSION) {
+      printf("Unsupported dump version\n");
+      fclose(importer->input);
+      return 0;
+    }
+    importer->format = DUMP_BINARY;
+    importer->expectedKeys = bytesToUInt64(header, DUMP_MAGIC_SIZE + 2);
+    readRecordLengths(importer);
+  } else {
+    importer->format = DUMP_TEXT;
+    rewind(importer->input);
+  }
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  importer->nworkers = cores > 1 ? cores - 1 : 1;
+  if (importer->nworkers > IMPORT_MAX_THREADS) {
+    importer->nworkers = IMPORT_MAX_THREADS;
+  }
+  importer->nchunks = 2 * importer->nworkers;
+  importer->chunks = calloc(importer->nchunks, sizeof(ImportChunk));
+  assert(importer->chunks != NULL);
+
+  pthread_mutex_init(&importer->lock, NULL);
+  pthread_cond_init(&importer->changed, NULL);
+  return 1;
+}
+
+static void importerClose(Importer *importer) {
+  for (int i = 0; i < importer->nchunks; i++) {
+    free(importer->chunks[i].data);
+    free(importer->chunks[i].records);
+  }
+  free(importer->chunks);
+  free(importer->carry);
+  free(importer->lengths);
+  fclose(importer->input);
+  pthread_mutex_destroy(&importer->lock);
+  pthread_cond_destroy(&importer->changed);
+}
+
+/*
+Parses the input in parallel and hands every record to consume, in input
+order. The record only lives until consume returns.
+*/
+static int runImport(Importer *importer, ImportConsumer consume,
+                     void *context) {
+  pthread_t reader;
+  pthread_t workers[IMPORT_MAX_THREADS];
+
+  pthread_create(&reader, NULL, importReader, importer);
+  for (int i = 0; i < importer->nworkers; i++) {
+    pthread_create(&workers[i], NULL, importWorker, importer);
+  }
+
+  int ok = 1;
+  for (uint64_t sequence = 0;; sequence++) {
+    pthread_mutex_lock(&importer->lock);
+    ImportChunk *chunk = &importer->chunks[sequence % importer->nchunks];
+    while (!importer->failed &&
+           !(importer->eof && sequence >= importer->totalChunks) &&
+           !(chunk->state == CHUNK_PARSED && chunk->sequence == sequence)) {
+      pthread_cond_wait(&importer->changed, &importer->lock);
+    }
+    if (importer->failed ||
+        (importer->eof && sequence >= importer->totalChunks)) {
+      ok = !importer->failed;
+      pthread_mutex_unlock(&importer->lock);
+      break;
+    }
+    pthread_mutex_unlock(&importer->lock);
+
+    if (chunk->error != NULL) {
+      printf("Import failed: %s\n", chunk->error);
+      ok = 0;
+    }
+    for (size_t i = 0; i < chunk->count && ok; i++) {
+      ok = consume(context, chunk->records[i]);
+    }
+
+    pthread_mutex_lock(&importer->lock);
+    chunk->state = CHUNK_EMPTY;
+    if (!ok) {
+      importer->failed = 1;
+    }
+    pthread_cond_broadcast(&importer->changed);
+    pthread_mutex_unlock(&importer->lock);
+
+    if (!ok) {
+      break;
+    }
+  }
+
+  pthread_join(reader, NULL);
+  for (int i = 0; i < importer->nworkers; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  return ok;
+}
+
+typedef struct SortedImport {
+  BulkLoader *loader;
+  KeyValue pending; // Held back until a larger key shows it's the last value
+  int hasPending;
+  int unsorted;
+} SortedImport;
+
+/*
+Records with equal keys collapse into the last one, as inserting them would.
+A dump announcing its key count gets a planned layout with room for exactly
+that many keys, so there a repeated key counts as unsorted input.
+*/
+static int consumeSorted(void *context, KeyValue kv) {
+  SortedImport *sorted = context;
+  if (sorted->hasPending) {
+    int order = compareKeyBytes(kv.key, kv.klen, sorted->pending);
+    if (order < 0 || (order == 0 && sorted->loader->expectedKeys > 0)) {
+      sorted->unsorted = 1;
+      return 0;
+    }
+    if (order > 0 && bulkLoaderAdd(sorted->loader, sorted->pending) != 1) {
+      return 0;
+    }
+  }
+
+  KeyValue *pending = &sorted->pending;
+  pending->key = realloc(pending->key, kv.klen + 1);
+  pending->value = realloc(pending->value, kv.vlen + 1);
+  assert(pending->key != NULL && pending->value != NULL);
+  memcpy(pending->key, kv.key, kv.klen);
+  memcpy(pending->value, kv.value, kv.vlen);
+  pending->klen = kv.klen;
+  pending->vlen = kv.vlen;
+  sorted->hasPending = 1;
+  return 1;
+}
+
+static int consumeInsert(void *context, KeyValue kv) {
+  if (insert((BTree *)context, kv) != 1) {
+    printf("Import failed: the key-value is too large to store\n");
+    return 0;
+  }
+  return 1;
+}
+
+/*
+Builds a new database file with the bulk loader and moves it into place.
+Sets unsorted when the input turned out not to be in key order.
+*/
+static int importSorted(Importer *importer, char *databaseFilename,
+                        int *unsorted) {
+  size_t nameLength = strlen(databaseFilename) + strlen(".import") + 1;
+  char *importName = malloc(nameLength);
+  snprintf(importName, nameLength, "%s.import", databaseFilename);
+
+  Storage *storage = storageOpen(importName, STORAGE_FILE, 1);
+  if (storage == NULL) {
+    free(importName);
+    return 0;
+  }
+
+  BTree target = {.root = BTREE_PAGE_SIZE,
+                  .last = BTREE_PAGE_SIZE,
+                  .storage = storage,
+                  .t = BTREE_DEFAULT_T,
+                  .filename = importName};
+  initTreeLatches(&target);
+
+  SortedImport sorted = {
+      .loader = bulkLoaderCreate(&target, importer->lengths,
+                                 importer->expectedKeys),
+      .hasPending = 0,
+      .unsorted = 0};
+  int ok = sorted.loader != NULL && runImport(importer, consumeSorted, &sorted);
+  ok = ok && (!sorted.hasPending ||
+              bulkLoaderAdd(sorted.loader, sorted.pending) == 1);
+  ok = ok && bulkLoaderFinish(sorted.loader) == 1;
+  bulkLoaderFree(sorted.loader);
+  free(sorted.pending.key);
+  free(sorted.pending.value);
+  destroyTreeLatches(&target);
+
+  ok = ok && storageSync(storage) == 1;
+  ok = ok && rename(importName, databaseFilename) == 0;
+  storageClose(storage);
+  if (!ok) {
+    unlink(importName);
+  }
+
+  *unsorted = sorted.unsorted;
+  free(importName);
+  return ok;
+}
+
+/*
+Inserts the records one by one under the exclusive flock, like kvdb put, and
+closes the tree.
+*/
+static int importInserts(Importer *importer, BTree *tree) {
+  if (tree == NULL) {
+    return 0;
+  }
+  if (lockTree(tree, LOCK_EX) != 1) {
+    perror("Failed to lock the database");
+    closeTree(tree);
+    return 0;
+  }
+  int ok = runImport(importer, consumeInsert, tree);
+  closeTree(tree);
+  return ok;
+}
+
+/*
+Loads a text (key:value per line) or binary dump into the database. A new
+database is bulk loaded when the input is sorted, an existing one gets the
+records inserted.
+*/
+int importFile(const char *filename, char *databaseFilename) {
+  Importer importer;
+  if (importerOpen(&importer, filename) != 1) {
+    return 0;
+  }
+
+  int ok;
+  if (access(databaseFilename, F_OK) == 0) {
+    ok = importInserts(&importer, treeFromFileName(databaseFilename));
+    importerClose(&importer);
+    return ok;
+  }
+
+  int unsorted = 0;
+  ok = importSorted(&importer, databaseFilename, &unsorted);
+  importerClose(&importer);
+  if (ok || !unsorted) {
+    return ok;
+  }
+
+  // Start over from the beginning of the input, one insert per record
+  printf("Import file can't be bulk loaded, inserting records one by one\n");
+  if (importerOpen(&importer, filename) != 1) {
+    return 0;
+  }
+  ok = importInserts(&importer, createTree(databaseFilename));
+  importerClose(&importer);
+  return ok;
+}
+
+static int writeTextRecord(FILE *out, KeyValue kv) {
+  if (memchr(kv.key, ':', kv.klen) != NULL ||
+      memchr(kv.key, '\n', kv.klen) != NULL ||
+      memchr(kv.value, '\n', kv.vlen) != NULL) {
+    printf("Key-value can't be written as text, use the binary format\n");
+    return 0;
+  }
+  return fwrite(kv.key, 1, kv.klen, out) == kv.klen && fputc(':', out) != EOF &&
+         fwrite(kv.value, 1, kv.vlen, out) == kv.vlen &&
+         fputc('\n', out) != EOF;
+}
+
+static int writeBinaryRecord(FILE *out, KeyValue kv) {
+  unsigned char header[KEYVALUE_HEADER];
+  uint16ToBytes(kv.klen, header, 0);
+  uint16ToBytes(kv.vlen, header, 2);
+  return fwrite(header, 1, KEYVALUE_HEADER, out) == KEYVALUE_HEADER &&
+         fwrite(kv.key, 1, kv.klen, out) == kv.klen &&
+         fwrite(kv.value, 1, kv.vlen, out) == kv.vlen;
+}
+
+/*
+Streams every key-value of the tree, in key order, to filename. The output is
+sorted, so importing it into a new database goes through the bulk loader.
+*/
+int exportTree(BTree *tree, const char *filename, DumpFormat format) {
+  FILE *out = fopen(filename, "wb");
+  if (out == NULL) {
+    perror("Failed to open the export file");
+    return 0;
+  }
+  setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+  unsigned char header[DUMP_HEADER_SIZE];
+  memcpy(header, DUMP_MAGIC, DUMP_MAGIC_SIZE);
+  uint16ToBytes(DUMP_VERSION, header, DUMP_MAGIC_SIZE);
+  uint64ToBytes(0, header, DUMP_MAGIC_SIZE + 2);
+
+  int ok = 1;
+  if (format == DUMP_BINARY) {
+    ok = fwrite(header, 1, DUMP_HEADER_SIZE, out) == DUMP_HEADER_SIZE;
+  }
+
+  Cursor *cursor = cursorOpen(tree);
+  ok = ok && cursor != NULL;
+
+  uint64_t count = 0;
+  KeyValue kv;
+  int status;
+  while (ok && (status = cursorNext(cursor, &kv)) != 0) {
+    ok = status == 1 && (format == DUMP_TEXT ? writeTextRecord(out, kv)
+                                             : writeBinaryRecord(out, kv));
+    count++;
+  }
+  cursorClose(cursor);
+
+  // The count is only known at the end
+  if (ok && format == DUMP_BINARY) {
+    uint64ToBytes(count, header, DUMP_MAGIC_SIZE + 2);
+    ok = fseek(out, 0, SEEK_SET) == 0 &&
+         fwrite(header, 1, DUMP_HEADER_SIZE, out) == DUMP_HEADER_SIZE;
+  }
+
+  ok = fclose(out) == 0 && ok;
+  if (!ok) {
+    printf("Export failed\n");
+  }
+  return ok;
+}
@@ -0,0 +1,82 @@
+#ifndef DUMP_H
+#define DUMP_H
+
+#include "btree.h"
+#include <pthread.h>
+#include <stddef.h>
+
+/*
+Binary dump layout, all integers big-endian like the nodes:
+| magic | version | count |  records ...
+|  8B   |   2B    |  8B   |
+Each record is
+| klen | vlen | key | val |
+|  2B  |  2B  | ... | ... |
+*/
+#define DUMP_MAGIC "KVDBDUMP"
+#define DUMP_MAGIC_SIZE 8
+#define DUMP_VERSION 1
+#define DUMP_HEADER_SIZE 18
+#define KEYVALUE_HEADER 4
+
+#define IMPORT_CHUNK_SIZE (4 << 20)
+#define IMPORT_MAX_THREADS 8
+
+typedef enum DumpFormat { DUMP_TEXT, DUMP_BINARY } DumpFormat;
+
+typedef enum ChunkState {
+  CHUNK_EMPTY,
+  CHUNK_FILLED,
+  CHUNK_PARSING,
+  CHUNK_PARSED
+} ChunkState;
+
+/*
+A slice of the input that ends on a record boundary, and the records parsed
+out of it. Records point into `data`, nothing is copied.
+*/
+typedef struct ImportChunk {
+  char *data;
+  size_t length;
+  size_t capacity;
+  KeyValue *records;
+  size_t count;
+  size_t recordCapacity;
+  uint64_t sequence;
+  ChunkState state;
+  const char *error;
+} ImportChunk;
+
+/*
+One reader thread cuts the input into chunks, a pool of workers parses them
+in any order and the caller consumes them in input order. Only a fixed ring
+of chunks is ever allocated, so memory stays bounded whatever the input
+size.
+*/
+typedef struct Importer {
+  FILE *input;
+  DumpFormat format;
+  uint64_t expectedKeys; // From the binary dump header, 0 for text
+  uint16_t *lengths;     // Key and value bytes of each record, NULL for text
+
+  int nworkers;
+  ImportChunk *chunks;
+  int nchunks;
+  uint64_t nextFill;
+  uint64_t nextParse;
+  uint64_t totalChunks; // Known once the input is exhausted
+  int eof;
+  int failed;
+
+  char *carry; // Incomplete record at the end of the last chunk
+  size_t carryLength;
+  size_t carryCapacity;
+
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+} Importer;
+
+int exportTree(BTree *tree, const char *filename, DumpFormat format);
+int importFile(const char *filename, char *databaseFilename);
+
+#endif // DUMP_H
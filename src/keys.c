@@ -0,0 +1,163 @@
+#include "keys.h"
+#include "utils.h"
+#include <math.h>
+#include <string.h>
+
+#define KEY_SIGN_BIT 0x8000000000000000ULL
+#define KEY_CANONICAL_NAN 0x7FF8000000000000ULL
+
+// A zero byte in a string is written as KEY_ESCAPE KEY_ESCAPED_ZERO, and
+// KEY_ESCAPE KEY_STRING_END ends it, below any byte the string could go on
+// with
+#define KEY_ESCAPE 0x00
+#define KEY_ESCAPED_ZERO 0xFF
+#define KEY_STRING_END 0x01
+
+void keyBegin(KeyBuilder *key) { key->length = 0; }
+
+/*
+Appends an unsigned integer, big-endian so memcmp compares it as a number.
+Returns 1 on success, 0 when the key would grow past BTREE_MAX_KEY_SIZE, the
+key is left as it was then.
+*/
+int keyAddU64(KeyBuilder *key, uint64_t value) {
+  if (key->length + 8 > BTREE_MAX_KEY_SIZE) {
+    return 0;
+  }
+  uint64ToBytes(value, (unsigned char *)key->bytes, key->length);
+  key->length += 8;
+  return 1;
+}
+
+// Flipping the sign bit puts negative numbers before positive ones
+int keyAddI64(KeyBuilder *key, int64_t value) {
+  return keyAddU64(key, (uint64_t)value ^ KEY_SIGN_BIT);
+}
+
+/*
+Positive doubles get their sign bit set, negative ones have every bit
+flipped so larger magnitudes sort first. -0.0 is stored as 0.0 and every NaN
+as the same NaN, after infinity.
+*/
+int keyAddDouble(KeyBuilder *key, double value) {
+  uint64_t bits;
+  if (isnan(value)) {
+    bits = KEY_CANONICAL_NAN;
+  } else {
+    value = value == 0.0 ? 0.0 : value;
+    memcpy(&bits, &value, sizeof(bits));
+  }
+  bits = bits & KEY_SIGN_BIT ? ~bits : bits | KEY_SIGN_BIT;
+  return keyAddU64(key, bits);
+}
+
+// Bytes a string takes encoded, its end included
+uint32_t keyStringSize(const char *bytes, uint16_t length) {
+  uint32_t encoded = length + 2;
+  for (uint16_t i = 0; i < length; i++) {
+    encoded += bytes[i] == KEY_ESCAPE;
+  }
+  return encoded;
+}
+
+/*
+Writes a string to out escaping its zero bytes, see KEY_ESCAPE, and ends it
+when end is set. Without its end the encoding is a prefix of the encoding of
+every string starting with the same bytes.
+Returns how many bytes were written, at most keyStringSize.
+*/
+uint32_t keyEncodeString(char *out, const char *bytes, uint16_t length,
+                         int end) {
+  uint32_t written = 0;
+  for (uint16_t i = 0; i < length; i++) {
+    out[written++] = bytes[i];
+    if (bytes[i] == KEY_ESCAPE) {
+      out[written++] = (char)KEY_ESCAPED_ZERO;
+    }
+  }
+  if (end) {
+    out[written++] = KEY_ESCAPE;
+    out[written++] = KEY_STRING_END;
+  }
+  return written;
+}
+
+// Appends a string with keyEncodeString
+int keyAddString(KeyBuilder *key, const char *bytes, uint16_t length) {
+  if (key->length + keyStringSize(bytes, length) > BTREE_MAX_KEY_SIZE) {
+    return 0;
+  }
+  key->length += keyEncodeString(key->bytes + key->length, bytes, length, 1);
+  return 1;
+}
+
+void keyReaderOpen(KeyReader *reader, const char *bytes, uint16_t length) {
+  reader->bytes = bytes;
+  reader->length = length;
+  reader->position = 0;
+}
+
+/*
+Reads the next part as an unsigned integer.
+Returns 1 on success, 0 when the key has no 8 bytes left.
+*/
+int keyReadU64(KeyReader *reader, uint64_t *value) {
+  if (reader->position + 8 > reader->length) {
+    return 0;
+  }
+  *value = bytesToUInt64((unsigned char *)reader->bytes, reader->position);
+  reader->position += 8;
+  return 1;
+}
+
+int keyReadI64(KeyReader *reader, int64_t *value) {
+  uint64_t bits;
+  if (!keyReadU64(reader, &bits)) {
+    return 0;
+  }
+  *value = (int64_t)(bits ^ KEY_SIGN_BIT);
+  return 1;
+}
+
+int keyReadDouble(KeyReader *reader, double *value) {
+  uint64_t bits;
+  if (!keyReadU64(reader, &bits)) {
+    return 0;
+  }
+  bits = bits & KEY_SIGN_BIT ? bits & ~KEY_SIGN_BIT : ~bits;
+  memcpy(value, &bits, sizeof(bits));
+  return 1;
+}
+
+/*
+Reads the next part as a string into buffer, which holds capacity bytes, and
+sets length to its length. The string is not terminated.
+Returns 1 on success, 0 when the string is malformed or doesn't fit.
+*/
+int keyReadString(KeyReader *reader, char *buffer, uint16_t capacity,
+                  uint16_t *length) {
+  uint16_t position = reader->position;
+  uint16_t written = 0;
+  while (position < reader->length) {
+    unsigned char byte = reader->bytes[position++];
+    if (byte == KEY_ESCAPE) {
+      if (position == reader->length) {
+        return 0;
+      }
+      unsigned char next = reader->bytes[position++];
+      if (next == KEY_STRING_END) {
+        reader->position = position;
+        *length = written;
+        return 1;
+      }
+      if (next != KEY_ESCAPED_ZERO) {
+        return 0;
+      }
+    }
+    if (written == capacity) {
+      return 0;
+    }
+    buffer[written++] = byte;
+  }
+  return 0;
+}
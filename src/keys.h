@@ -0,0 +1,46 @@
+#ifndef KEYS_H
+#define KEYS_H
+
+#include "btree.h"
+#include <stdint.h>
+
+/*
+Order-preserving key encodings. Keys built from typed parts compare with
+memcmp, which is how nodes compare keys, in the order the parts compare in,
+first part first, so integers sort as numbers without padding them as text.
+Integers and doubles take 8 bytes. Strings take their bytes, one more per
+zero byte and 2 to end them, so a part never runs into the next one.
+A key built from the first parts of another is a prefix of it, so
+prefixScan finds every key starting with the same parts.
+Keys can hold zero bytes, look them up with searchKeyBytes and delete them
+with deleteKeyBytes.
+*/
+typedef struct KeyBuilder {
+  char bytes[BTREE_MAX_KEY_SIZE];
+  uint16_t length;
+} KeyBuilder;
+
+// Reads the parts of a key back, in the order they were added
+typedef struct KeyReader {
+  const char *bytes;
+  uint16_t length;
+  uint16_t position;
+} KeyReader;
+
+void keyBegin(KeyBuilder *key);
+int keyAddU64(KeyBuilder *key, uint64_t value);
+int keyAddI64(KeyBuilder *key, int64_t value);
+int keyAddDouble(KeyBuilder *key, double value);
+int keyAddString(KeyBuilder *key, const char *bytes, uint16_t length);
+uint32_t keyStringSize(const char *bytes, uint16_t length);
+uint32_t keyEncodeString(char *out, const char *bytes, uint16_t length,
+                         int end);
+
+void keyReaderOpen(KeyReader *reader, const char *bytes, uint16_t length);
+int keyReadU64(KeyReader *reader, uint64_t *value);
+int keyReadI64(KeyReader *reader, int64_t *value);
+int keyReadDouble(KeyReader *reader, double *value);
+int keyReadString(KeyReader *reader, char *buffer, uint16_t capacity,
+                  uint16_t *length);
+
+#endif // KEYS_H
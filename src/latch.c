@@ -0,0 +1,179 @@
+#include "latch.h"
+#include "btree.h"
+#include <assert.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+LatchTable *latchTableCreate() {
+  LatchTable *table = calloc(1, sizeof(LatchTable));
+  if (table == NULL) {
+    perror("Memory allocation failed");
+    return NULL;
+  }
+  pthread_mutex_init(&table->growLock, NULL);
+  return table;
+}
+
+void latchTableFree(LatchTable *table) {
+  if (table == NULL) {
+    return;
+  }
+  for (int i = 0; i < LATCH_DIRECTORY_SIZE; i++) {
+    free(atomic_load(&table->chunks[i]));
+  }
+  pthread_mutex_destroy(&table->growLock);
+  free(table);
+}
+
+// Chunk holding the latch of page, and the page's slot in it
+static LatchChunk *chunkFor(LatchTable *table, NodePointer page,
+                            uint64_t *slot) {
+  uint64_t number = (page / BTREE_PAGE_SIZE) %
+                    ((uint64_t)LATCH_DIRECTORY_SIZE * LATCH_CHUNK_PAGES);
+  uint64_t index = number / LATCH_CHUNK_PAGES;
+  *slot = number % LATCH_CHUNK_PAGES;
+
+  LatchChunk *chunk = atomic_load(&table->chunks[index]);
+  if (chunk == NULL) {
+    pthread_mutex_lock(&table->growLock);
+    chunk = atomic_load(&table->chunks[index]);
+    if (chunk == NULL) {
+      chunk = calloc(1, sizeof(LatchChunk));
+      assert(chunk != NULL);
+      atomic_store(&table->chunks[index], chunk);
+    }
+    pthread_mutex_unlock(&table->growLock);
+  }
+  return chunk;
+}
+
+static PageVersion *versionFor(LatchTable *table, NodePointer page) {
+  uint64_t slot;
+  LatchChunk *chunk = chunkFor(table, page, &slot);
+  return &chunk->versions[slot];
+}
+
+/*
+Waits until no writer holds the page and returns its version. Anything read
+from the page afterwards is only trustworthy once latchValidate agrees.
+*/
+uint64_t latchReadBegin(LatchTable *table, NodePointer page) {
+  PageVersion *version = versionFor(table, page);
+  for (;;) {
+    uint64_t current = atomic_load(version);
+    if ((current & 1) == 0) {
+      return current;
+    }
+    sched_yield();
+  }
+}
+
+int latchValidate(LatchTable *table, NodePointer page, uint64_t version) {
+  return atomic_load(versionFor(table, page)) == version;
+}
+
+/*
+Locks a page read optimistically, as long as it is still at the version the
+reader saw. Never waits.
+Returns 1 when the page is locked, 0 when the caller must start over.
+*/
+int latchUpgrade(LatchTable *table, NodePointer page, uint64_t version) {
+  return atomic_compare_exchange_strong(versionFor(table, page), &version,
+                                        version + 1);
+}
+
+void latchExclusive(LatchTable *table, NodePointer page) {
+  PageVersion *version = versionFor(table, page);
+  for (;;) {
+    uint64_t current = atomic_load(version);
+    if ((current & 1) == 0 &&
+        atomic_compare_exchange_weak(version, &current, current + 1)) {
+      return;
+    }
+    sched_yield();
+  }
+}
+
+// For pages nobody else can reach yet, never waits
+int latchTryExclusive(LatchTable *table, NodePointer page) {
+  PageVersion *version = versionFor(table, page);
+  uint64_t current = atomic_load(version);
+  return (current & 1) == 0 &&
+         atomic_compare_exchange_strong(version, &current, current + 1);
+}
+
+// Releases an exclusive latch, readers that overlapped the writer start over
+void unlatch(LatchTable *table, NodePointer page) {
+  uint64_t previous = atomic_fetch_add(versionFor(table, page), 1);
+  assert(previous & 1);
+}
+
+/*
+Counts one in LATCH_HEAT_SAMPLE reads of each thread, so reads of a hot page
+don't all write its cache line. Increments racing each other may be lost.
+*/
+void latchTouch(LatchTable *table, NodePointer page) {
+  static _Thread_local uint32_t reads = 0;
+  if (++reads % LATCH_HEAT_SAMPLE != 0) {
+    return;
+  }
+  uint64_t slot;
+  LatchChunk *chunk = chunkFor(table, page, &slot);
+  uint32_t heat =
+      atomic_load_explicit(&chunk->heat[slot], memory_order_relaxed);
+  atomic_store_explicit(&chunk->heat[slot], heat + 1, memory_order_relaxed);
+}
+
+typedef struct PageHeat {
+  NodePointer page;
+  uint32_t heat;
+} PageHeat;
+
+static int hotterFirst(const void *a, const void *b) {
+  uint32_t heatA = ((const PageHeat *)a)->heat;
+  uint32_t heatB = ((const PageHeat *)b)->heat;
+  return heatA < heatB ? 1 : heatA > heatB ? -1 : 0;
+}
+
+/*
+Fills pages with up to limit of the most read pages, hottest first.
+Returns how many were found.
+*/
+int latchHottest(LatchTable *table, NodePointer *pages, int limit) {
+  PageHeat *heats = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+
+  for (uint64_t i = 0; i < LATCH_DIRECTORY_SIZE; i++) {
+    LatchChunk *chunk = atomic_load(&table->chunks[i]);
+    if (chunk == NULL) {
+      continue;
+    }
+    for (uint64_t j = 0; j < LATCH_CHUNK_PAGES; j++) {
+      uint32_t heat = atomic_load(&chunk->heat[j]);
+      if (heat == 0) {
+        continue;
+      }
+      if (count == capacity) {
+        capacity = capacity == 0 ? 1024 : capacity * 2;
+        heats = realloc(heats, capacity * sizeof(PageHeat));
+        assert(heats != NULL);
+      }
+      heats[count].page = (i * LATCH_CHUNK_PAGES + j) * BTREE_PAGE_SIZE;
+      heats[count].heat = heat;
+      count++;
+    }
+  }
+  if (count == 0) {
+    return 0;
+  }
+
+  qsort(heats, count, sizeof(PageHeat), hotterFirst);
+  int found = count < (size_t)limit ? count : limit;
+  for (int i = 0; i < found; i++) {
+    pages[i] = heats[i].page;
+  }
+  free(heats);
+  return found;
+}
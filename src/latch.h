@@ -0,0 +1,48 @@
+#ifndef LATCH_H
+#define LATCH_H
+
+#include "btree.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define LATCH_CHUNK_PAGES 1024
+#define LATCH_DIRECTORY_SIZE 65536
+#define LATCH_HEAT_SAMPLE 64 // Reads per thread between two counted ones
+
+/*
+Version word of a page. Odd while a writer holds the page, and bumped every
+time the writer releases it, so a reader can tell whether a page changed
+under it by comparing versions.
+*/
+typedef _Atomic uint64_t PageVersion;
+
+typedef struct LatchChunk {
+  PageVersion versions[LATCH_CHUNK_PAGES];
+  _Atomic uint32_t heat[LATCH_CHUNK_PAGES]; // Sampled point reads
+} LatchChunk;
+
+/*
+Optimistic latch per page, indexed by page number. Readers take no lock:
+they note the version, copy the page and check the version didn't move.
+Writers lock a page by making its version odd. Each page also counts a
+sample of the lookups and inserts that read it, to find the hot pages.
+Chunks are allocated the first time one of their pages is latched and never
+move. Files bigger than the directory wrap around and share latches.
+*/
+typedef struct LatchTable {
+  _Atomic(LatchChunk *) chunks[LATCH_DIRECTORY_SIZE];
+  pthread_mutex_t growLock;
+} LatchTable;
+
+LatchTable *latchTableCreate();
+void latchTableFree(LatchTable *table);
+uint64_t latchReadBegin(LatchTable *table, NodePointer page);
+int latchValidate(LatchTable *table, NodePointer page, uint64_t version);
+int latchUpgrade(LatchTable *table, NodePointer page, uint64_t version);
+void latchExclusive(LatchTable *table, NodePointer page);
+int latchTryExclusive(LatchTable *table, NodePointer page);
+void unlatch(LatchTable *table, NodePointer page);
+void latchTouch(LatchTable *table, NodePointer page);
+int latchHottest(LatchTable *table, NodePointer *pages, int limit);
+
+#endif // LATCH_H
@@ -1,10 +1,22 @@
+#include "bench.h"
 #include "btree.h"
+#include "bulkload.h"
+#include "dump.h"
+#include "secondary.h"
+#include "selftest.h"
+#include "shadow.h"
+#include "storage.h"
+#include "update.h"
 #include "utils.h"
 #include <assert.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
 #include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
 
 #define SAMPLE_BYTES_SIZE
 unsigned char SAMPLE_BYTES[SAMPLE_BYTES_SIZE] = {
@@ -40,7 +52,240 @@ unsigned char SAMPLE_BYTES[SAMPLE_BYTES_SIZE] = {
 
 */
 
-int main() {
+static char *databasePath() {
+  char *path = getenv("KVDB_FILE");
+  return path != NULL ? path : "db.bin";
+}
+
+// The flock a command holds on the database, shared for those that only read
+static int lockOperation(const char *command) {
+  const char *shared[] = {"get", "keys", "find", "export", "compact"};
+  for (size_t i = 0; i < sizeof(shared) / sizeof(shared[0]); i++) {
+    if (strcmp(command, shared[i]) == 0) {
+      return LOCK_SH;
+    }
+  }
+  return LOCK_EX;
+}
+
+/*
+Compactions only share the flock of the database, they take turns on the
+exclusive flock of a lock file beside it instead, which is taken first so
+that lockTree finds the file a previous compaction left.
+Returns the descriptor holding the lock, -1 on failure.
+*/
+static int lockCompaction(const char *path) {
+  size_t length = strlen(path) + strlen(".compact.lock") + 1;
+  char *name = malloc(length);
+  snprintf(name, length, "%s.compact.lock", path);
+  int fd = open(name, O_RDWR | O_CREAT, 0644);
+  free(name);
+  if (fd == -1) {
+    return -1;
+  }
+  if (flock(fd, LOCK_EX) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// KVDB_STORAGE picks the backend: file (default), mmap or memory for bench
+static int storageKind(StorageKind *kind) {
+  char *name = getenv("KVDB_STORAGE");
+  if (name == NULL) {
+    *kind = STORAGE_FILE;
+    return 1;
+  }
+  if (storageKindFromName(name, kind) != 1) {
+    printf("Unknown storage %s\n", name);
+    return 0;
+  }
+  return 1;
+}
+
+static void printUsage() {
+  printf("Usage: kvdb compact\n");
+  printf("       kvdb shadow\n");
+  printf("       kvdb put {key} {value}\n");
+  printf("       kvdb get {key}\n");
+  printf("       kvdb delete {key}\n");
+  printf("       kvdb incr {key} [delta]\n");
+  printf("       kvdb cas {key} {expected} {desired}\n");
+  printf("       kvdb append {key} {suffix}\n");
+  printf("       kvdb index [prefix length]\n");
+  printf("       kvdb find {value} [exact|prefix]\n");
+  printf("       kvdb keys {prefix} [limit]\n");
+  printf("       kvdb import {file}\n");
+  printf("       kvdb export {file} [binary|text]\n");
+  printf("       kvdb bench {threads} {keys} [shards] [shadow]\n");
+  printf("       kvdb selftest\n");
+  printf("The database file is taken from KVDB_FILE (default db.bin) and\n");
+  printf("KVDB_STORAGE picks how it is accessed: file or mmap, and memory\n");
+  printf("for kvdb bench only\n");
+  printf("kvdb shadow turns on copy-on-write writes for the database, the\n");
+  printf("shadow benchmark runs with them\n");
+}
+
+static int isAtomicUpdate(int argc, char **argv) {
+  return (strcmp(argv[0], "incr") == 0 && (argc == 2 || argc == 3)) ||
+         (strcmp(argv[0], "cas") == 0 && argc == 4) ||
+         (strcmp(argv[0], "append") == 0 && argc == 3);
+}
+
+// Runs incr, cas or append, the caller holds the file's exclusive flock
+static int runAtomicUpdate(BTree *tree, int argc, char **argv) {
+  if (strcmp(argv[0], "incr") == 0) {
+    int64_t delta = argc == 3 ? atoll(argv[2]) : 1;
+    int64_t result;
+    int ok = incrementValue(tree, argv[1], delta, &result);
+    if (ok == 1) {
+      printf("%" PRId64 "\n", result);
+    } else {
+      printf("The value of %s is not an integer\n", argv[1]);
+    }
+    return ok;
+  }
+  if (strcmp(argv[0], "cas") == 0) {
+    return compareAndSwapValue(tree, argv[1], argv[2], strlen(argv[2]),
+                               argv[3], strlen(argv[3]));
+  }
+  return appendValue(tree, argv[1], argv[2], strlen(argv[2]));
+}
+
+static int printKey(void *context, const KeyValue *kv) {
+  (void)context;
+  printf("%.*s\n", kv->klen, kv->key);
+  return 1;
+}
+
+static int runCommand(int argc, char **argv) {
+  StorageKind kind;
+  if (storageKind(&kind) != 1) {
+    return 1;
+  }
+
+  if (strcmp(argv[0], "selftest") == 0 && argc == 1) {
+    return runSelfTest() == 1 ? 0 : 1;
+  }
+
+  // Importing into a missing database creates it
+  if (strcmp(argv[0], "import") == 0 && argc == 2) {
+    return importFile(argv[1], databasePath()) == 1 ? 0 : 1;
+  }
+
+  // Benchmarks run on a scratch file next to the database
+  if (strcmp(argv[0], "bench") == 0 && argc >= 3 && argc <= 5) {
+    char filename[4096];
+    snprintf(filename, sizeof(filename), "%s.bench", databasePath());
+    uint64_t keys = strtoull(argv[2], NULL, 10);
+    int shards = argc >= 4 ? atoi(argv[3]) : 0;
+    int shadow = argc == 5 && strcmp(argv[4], "shadow") == 0;
+    int ok =
+        benchInserts(filename, atoi(argv[1]), keys, shards, kind, shadow);
+    return ok == 1 ? 0 : 1;
+  }
+
+  // Nothing would be left of an in-memory database once the command ends
+  if (kind == STORAGE_MEMORY) {
+    printf("Memory storage is only used by kvdb bench\n");
+    return 1;
+  }
+
+  Storage *storage = storageOpen(databasePath(), kind, 0);
+  BTree *tree =
+      storage != NULL ? treeFromStorage(storage, databasePath()) : NULL;
+  if (tree == NULL) {
+    return 1;
+  }
+
+  /*
+  Writers of concurrent kvdb processes take turns: incr, cas and append
+  read and write the key under the exclusive flock, and closing, which
+  writes the header, drops it. Lookups share the flock, and so does a
+  compaction, which only writes its new file: it keeps writers out while it
+  copies, not readers. The header read before locking may be stale, and the
+  file may have been compacted into a new one meanwhile.
+  */
+  int compaction = -1;
+  if (strcmp(argv[0], "compact") == 0 &&
+      (compaction = lockCompaction(databasePath())) == -1) {
+    perror("Failed to lock the compaction");
+    closeTree(tree);
+    return 1;
+  }
+  if (lockTree(tree, lockOperation(argv[0])) != 1) {
+    perror("Failed to lock the database");
+    closeTree(tree);
+    if (compaction != -1) {
+      close(compaction);
+    }
+    return 1;
+  }
+
+  int ok = -1;
+  if (strcmp(argv[0], "compact") == 0) {
+    ok = compactTree(tree);
+  } else if (strcmp(argv[0], "shadow") == 0 && argc == 1) {
+    ok = enableShadowPaging(tree);
+  } else if (strcmp(argv[0], "put") == 0 && argc == 3) {
+    KeyValue kv = {.klen = strlen(argv[1]),
+                   .vlen = strlen(argv[2]),
+                   .key = argv[1],
+                   .value = argv[2]};
+    ok = insert(tree, kv);
+    if (ok != 1) {
+      printf("The key-value is too large to store\n");
+    }
+  } else if (strcmp(argv[0], "get") == 0 && argc == 2) {
+    KeyValue found;
+    ok = searchKeyValue(tree, argv[1], &found);
+    if (ok == 1) {
+      printf("%.*s\n", found.vlen, found.value);
+      free(found.key);
+      free(found.value);
+    }
+  } else if (strcmp(argv[0], "delete") == 0 && argc == 2) {
+    ok = deleteKeyValue(tree, argv[1]);
+  } else if (isAtomicUpdate(argc, argv)) {
+    ok = runAtomicUpdate(tree, argc, argv);
+  } else if (strcmp(argv[0], "index") == 0 && (argc == 1 || argc == 2)) {
+    uint16_t prefixLength = argc == 2 ? atoi(argv[1]) : 0;
+    ok = declareValueIndex(tree, prefixLength) != -1;
+  } else if (strcmp(argv[0], "find") == 0 && (argc == 2 || argc == 3)) {
+    int prefix = argc == 3 && strcmp(argv[2], "prefix") == 0;
+    KeyValue *keys = NULL;
+    int count = findKeysByValue(tree, argv[1], strlen(argv[1]), prefix, &keys);
+    for (int i = 0; i < count; i++) {
+      printf("%.*s\n", keys[i].klen, keys[i].key);
+      free(keys[i].key);
+    }
+    free(keys);
+    ok = count > 0;
+  } else if (strcmp(argv[0], "keys") == 0 && (argc == 2 || argc == 3)) {
+    int limit = argc == 3 ? atoi(argv[2]) : 0;
+    ok = prefixScan(tree, argv[1], strlen(argv[1]), limit, printKey, NULL) > 0;
+  } else if (strcmp(argv[0], "export") == 0 && (argc == 2 || argc == 3)) {
+    DumpFormat format =
+        argc == 3 && strcmp(argv[2], "text") == 0 ? DUMP_TEXT : DUMP_BINARY;
+    ok = exportTree(tree, argv[1], format);
+  } else {
+    printUsage();
+  }
+
+  // A clean close keeps the hot pages for the next run
+  closeTree(tree);
+  if (compaction != -1) {
+    close(compaction);
+  }
+  return ok == 1 ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    return runCommand(argc - 1, argv + 1);
+  }
+
   BTree *tree = createMockupTree();
   if (tree == NULL) {
     printf("COULDN?T CREATE MOCKUP TREE");
@@ -64,8 +309,9 @@ int main() {
   KeyValue foundKV;
   for (int i = 0; i < count; i++) {
     int wasFound = searchKeyValue(tree, result[i].key, &foundKV);
-    assert(wasFound && strcmp(charArrayToString(foundKV.value, foundKV.vlen),
-                              foundKV.key) == 0);
+    assert(wasFound == 1 &&
+           strcmp(charArrayToString(foundKV.value, foundKV.vlen),
+                  result[i].value) == 0);
   }
 }
 
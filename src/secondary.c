@@ -0,0 +1,315 @@
+#include "secondary.h"
+#include "btree.h"
+#include "keys.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// An index shares everything with the tree owning it but its root
+static BTree *indexTree(BTree *owner, NodePointer root) {
+  BTree *index = calloc(1, sizeof(BTree));
+  if (index == NULL) {
+    perror("Memory allocation failed");
+    return NULL;
+  }
+  index->root = root;
+  index->storage = owner->storage;
+  index->t = owner->t;
+  index->latches = owner->latches;
+  index->owner = owner;
+  return index;
+}
+
+/*
+Creates handles for the indexes the header lists, or moves the existing ones
+to the roots it holds now and to the tree's current storage.
+Returns 1 on success, 0 when out of memory.
+*/
+int openIndexes(BTree *tree) {
+  for (uint16_t i = 0; i < tree->indexCount; i++) {
+    if (tree->indexes[i] != NULL) {
+      tree->indexes[i]->root = tree->indexRoots[i];
+      tree->indexes[i]->storage = tree->storage;
+      continue;
+    }
+    tree->indexes[i] = indexTree(tree, tree->indexRoots[i]);
+    if (tree->indexes[i] == NULL) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Frees the index handles, their pages belong to the tree's storage
+void closeIndexes(BTree *tree) {
+  for (int i = 0; i < TREE_MAX_INDEXES; i++) {
+    free(tree->indexes[i]);
+    tree->indexes[i] = NULL;
+  }
+}
+
+// Bytes of a value of vlen bytes an index on prefixLength bytes keeps
+static uint16_t indexedLength(uint16_t prefixLength, uint16_t vlen) {
+  uint16_t length =
+      prefixLength == 0 || vlen < prefixLength ? vlen : prefixLength;
+  return length < INDEX_MAX_LENGTH ? length : INDEX_MAX_LENGTH;
+}
+
+// Entry of kv in index i. The caller frees its key, the value is kv's key
+static KeyValue indexEntry(BTree *tree, int i, KeyValue kv) {
+  uint16_t length = indexedLength(tree->indexPrefixes[i], kv.vlen);
+  uint32_t encoded = keyStringSize(kv.value, length);
+  KeyValue entry = {.klen = encoded + kv.klen,
+                    .vlen = kv.klen,
+                    .key = malloc(encoded + kv.klen),
+                    .value = kv.key};
+  assert(entry.key != NULL);
+  keyEncodeString(entry.key, kv.value, length, 1);
+  memcpy(entry.key + encoded, kv.key, kv.klen);
+  return entry;
+}
+
+// Writes the entry of a key-value, which always fits, see INDEX_MAX_LENGTH
+static void addEntry(BTree *index, KeyValue entry) {
+  Mutation mutation = {.kv = entry};
+  applyMutation(index, &mutation);
+  assert(mutation.applied);
+}
+
+// declareValueIndex for a new index, the caller holds writeLock exclusively
+static int buildValueIndex(BTree *tree, uint16_t prefixLength) {
+  if (tree->shadow != NULL) {
+    printf("Secondary indexes can't be used with shadow paging\n");
+    return -1;
+  }
+  if (tree->indexCount == TREE_MAX_INDEXES) {
+    printf("A tree can't have more than %d indexes\n", TREE_MAX_INDEXES);
+    return -1;
+  }
+
+  BTree *index = indexTree(tree, 0);
+  if (index == NULL) {
+    return -1;
+  }
+  Node *root = createNode(LEAF, tree->t);
+  root->pointers[0] = 0;
+  NodePointer rootPointer;
+  int ok = addNodeToFile(index, root, &rootPointer);
+  freeNode(root);
+  if (ok != 1) {
+    printf("Failed to write the root of the index\n");
+    free(index);
+    return -1;
+  }
+  index->root = rootPointer;
+
+  uint16_t number = tree->indexCount;
+  tree->indexPrefixes[number] = prefixLength;
+
+  // Only listed in the header once complete
+  Cursor *cursor = cursorOpen(tree);
+  KeyValue kv;
+  int status = -1;
+  while (cursor != NULL && (status = cursorNext(cursor, &kv)) == 1) {
+    KeyValue entry = indexEntry(tree, number, kv);
+    addEntry(index, entry);
+    free(entry.key);
+  }
+  cursorClose(cursor);
+
+  if (status != 0) {
+    printf("Failed to build the index\n");
+    free(index);
+    return -1;
+  }
+  tree->indexes[number] = index;
+  tree->indexRoots[number] = index->root;
+  tree->indexCount++;
+  updateTreeInFile(tree);
+  return number;
+}
+
+/*
+Declares an index on the first prefixLength bytes of the values, or on the
+whole values when it is 0, and builds it from the key-values stored so far.
+Indexes are kept in the file and maintained by every later open, so
+declaring one that exists just returns it. Writers wait for the build.
+Returns the number of the index, -1 on failure.
+*/
+int declareValueIndex(BTree *tree, uint16_t prefixLength) {
+  pthread_rwlock_wrlock(&tree->writeLock);
+  int number = -1;
+  for (uint16_t i = 0; i < tree->indexCount && number == -1; i++) {
+    if (tree->indexPrefixes[i] == prefixLength) {
+      number = i;
+    }
+  }
+  if (number == -1) {
+    number = buildValueIndex(tree, prefixLength);
+  }
+  pthread_rwlock_unlock(&tree->writeLock);
+  return number;
+}
+
+/*
+Builds the indexes of tree into target, a compacted copy of it without any,
+so they are in the new file before it replaces the old one. The caller holds
+writeLock of tree exclusively and closes the indexes of target.
+Returns 1 on success, 0 on failure.
+*/
+int rebuildIndexes(BTree *tree, BTree *target) {
+  for (uint16_t i = 0; i < tree->indexCount; i++) {
+    if (buildValueIndex(target, tree->indexPrefixes[i]) != i) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+Applies mutation to the tree, a tombstone included, and moves the key's
+entry in every index. Writers of an indexed tree take turns, so the indexes
+never miss a change or see two changes of a key in the wrong order.
+Returns mutation->applied.
+*/
+int indexedApply(BTree *tree, Mutation *mutation) {
+  pthread_rwlock_wrlock(&tree->writeLock);
+  KeyValue previous;
+  mutation->previous = &previous;
+  applyMutation(tree, mutation);
+  mutation->previous = NULL;
+  KeyValue kv = mutation->result;
+
+  for (uint16_t i = 0; mutation->applied && i < tree->indexCount; i++) {
+    KeyValue added = {.key = NULL};
+    if (!isTombstone(kv)) {
+      added = indexEntry(tree, i, kv);
+    }
+
+    int unchanged = 0;
+    if (mutation->replaced) {
+      KeyValue removed = indexEntry(tree, i, previous);
+      unchanged = added.key != NULL &&
+                  compareKeyBytes(removed.key, removed.klen, added) == 0;
+      if (!unchanged) {
+        removed.vlen = TOMBSTONE;
+        removed.value = NULL;
+        upsertKeyValue(tree->indexes[i], removed, NULL);
+      }
+      free(removed.key);
+    }
+
+    if (added.key != NULL && !unchanged) {
+      addEntry(tree->indexes[i], added);
+    }
+    free(added.key);
+  }
+
+  if (mutation->replaced) {
+    free(previous.key);
+    free(previous.value);
+  }
+  pthread_rwlock_unlock(&tree->writeLock);
+  return mutation->applied;
+}
+
+// Checks the stored value of key, for entries that only kept a prefix of it
+static int valueMatches(BTree *tree, KeyValue key, const char *value,
+                        uint16_t vlen, int prefix) {
+  KeyValue found;
+  int matches = 0;
+  if (searchKeyBytes(tree, key.key, key.klen, &found) == 1) {
+    matches = (prefix ? found.vlen >= vlen : found.vlen == vlen) &&
+              memcmp(found.value, value, vlen) == 0;
+    free(found.key);
+    free(found.value);
+  }
+  return matches;
+}
+
+/*
+Finds the keys whose value is value, or starts with it when prefix is set,
+through the index keeping the most of each value. Only entries starting with
+the encoded bytes looked for are read, ended for an exact match, and the
+stored values are only looked at when the index keeps less of them than the
+lookup needs.
+keys receives an array holding just the keys, the caller frees it and each
+key.
+Returns how many keys were found, -1 without an index or on a read error.
+*/
+int findKeysByValue(BTree *tree, const char *value, uint16_t vlen, int prefix,
+                    KeyValue **keys) {
+  int best = -1;
+  for (uint16_t i = 0; i < tree->indexCount; i++) {
+    uint16_t candidate = tree->indexPrefixes[i];
+    if (best == -1 || candidate == 0 ||
+        (tree->indexPrefixes[best] != 0 &&
+         candidate > tree->indexPrefixes[best])) {
+      best = i;
+    }
+  }
+  if (best == -1) {
+    printf("The tree has no index on its values\n");
+    return -1;
+  }
+
+  // No value stored is longer, and the encoded bytes must fit a key length
+  if (vlen > BTREE_MAX_VAL_SIZE) {
+    *keys = NULL;
+    return 0;
+  }
+
+  uint16_t prefixLength = tree->indexPrefixes[best];
+  uint16_t length = indexedLength(prefixLength, vlen);
+  // Whether the indexed bytes alone decide a match, values as long as the
+  // most the index keeps may go on
+  uint16_t kept = indexedLength(prefixLength, BTREE_MAX_VAL_SIZE);
+  int complete = prefix ? length == vlen : vlen < kept;
+
+  char *start = malloc(keyStringSize(value, length));
+  assert(start != NULL);
+  uint32_t startLength = keyEncodeString(start, value, length, !prefix);
+
+  // Excludes writers, which may be moving entries around
+  pthread_rwlock_rdlock(&tree->writeLock);
+  Cursor *cursor = cursorSeek(tree->indexes[best], start, startLength);
+  KeyValue *found = NULL;
+  int count = 0;
+  int status = -1;
+  KeyValue entry;
+  while (cursor != NULL && (status = cursorNext(cursor, &entry)) == 1) {
+    if (entry.klen < startLength ||
+        memcmp(entry.key, start, startLength) != 0) {
+      status = 0;
+      break;
+    }
+
+    KeyValue key = {.klen = entry.vlen, .vlen = 0, .value = NULL};
+    key.key = malloc(key.klen);
+    assert(key.key != NULL);
+    memcpy(key.key, entry.value, key.klen);
+    if (!complete && !valueMatches(tree, key, value, vlen, prefix)) {
+      free(key.key);
+      continue;
+    }
+
+    found = realloc(found, (count + 1) * sizeof(KeyValue));
+    assert(found != NULL);
+    found[count++] = key;
+  }
+  cursorClose(cursor);
+  pthread_rwlock_unlock(&tree->writeLock);
+  free(start);
+
+  if (status != 0) {
+    for (int i = 0; i < count; i++) {
+      free(found[i].key);
+    }
+    free(found);
+    return -1;
+  }
+  *keys = found;
+  return count;
+}
@@ -0,0 +1,33 @@
+#ifndef SECONDARY_H
+#define SECONDARY_H
+
+#include "btree.h"
+
+/*
+A secondary index is a B-tree in the same file as the tree it indexes,
+sharing its pages, latches and header. Every live key-value of the tree has
+one entry in it:
+|                 key                  |    value    |
+| encoded value (or its prefix) ++ key | primary key |
+The indexed part of the value is encoded like a string part of keys.h, its
+zero bytes escaped and an end appended, so entries sort by value first and
+entries of a value come before those of the values it is a prefix of.
+No more than INDEX_MAX_LENGTH bytes of a value are indexed, however long the
+index's prefix, so that an entry fits a node even when the bytes escaped are
+all zero and the key is as long as it gets; lookups check the stored values
+of longer ones.
+*/
+
+// An entry's record holds two lengths, the key twice and the value escaped
+#define INDEX_MAX_LENGTH                                                       \
+  ((BTREE_MAX_RECORD_SIZE - 4 - 2 - 2 * BTREE_MAX_KEY_SIZE) / 2)
+
+int openIndexes(BTree *tree);
+void closeIndexes(BTree *tree);
+int declareValueIndex(BTree *tree, uint16_t prefixLength);
+int rebuildIndexes(BTree *tree, BTree *target);
+int indexedApply(BTree *tree, Mutation *mutation);
+int findKeysByValue(BTree *tree, const char *value, uint16_t vlen, int prefix,
+                    KeyValue **keys);
+
+#endif // SECONDARY_H
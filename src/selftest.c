@@ -0,0 +1,394 @@
+#include "selftest.h"
+#include "btree.h"
+#include "keys.h"
+#include "secondary.h"
+#include "shadow.h"
+#include "storage.h"
+#include "update.h"
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct TestString {
+  const char *bytes;
+  uint16_t length;
+} TestString;
+
+static int failures = 0;
+
+static void check(int ok, const char *what, int index) {
+  if (!ok) {
+    printf("Self test failed: %s (case %d)\n", what, index);
+    failures++;
+  }
+}
+
+// Orders encoded keys the way nodes do, by memcmp with the shorter first
+static int compareEncoded(const KeyBuilder *a, const KeyBuilder *b) {
+  uint16_t shorter = a->length < b->length ? a->length : b->length;
+  int order = memcmp(a->bytes, b->bytes, shorter);
+  if (order != 0) {
+    return order;
+  }
+  return a->length < b->length ? -1 : a->length > b->length ? 1 : 0;
+}
+
+// Values in ascending order, encoded one by one
+static void checkU64() {
+  uint64_t values[] = {0, 1, 255, 256, 1ULL << 32, UINT64_MAX - 1, UINT64_MAX};
+  int count = sizeof(values) / sizeof(values[0]);
+  KeyBuilder previous;
+  for (int i = 0; i < count; i++) {
+    KeyBuilder key;
+    keyBegin(&key);
+    check(keyAddU64(&key, values[i]), "u64 fits", i);
+    check(i == 0 || compareEncoded(&previous, &key) < 0, "u64 order", i);
+
+    KeyReader reader;
+    uint64_t read = 0;
+    keyReaderOpen(&reader, key.bytes, key.length);
+    check(keyReadU64(&reader, &read) && read == values[i], "u64 round trip",
+          i);
+    previous = key;
+  }
+}
+
+static void checkI64() {
+  int64_t values[] = {INT64_MIN,   INT64_MIN + 1, -(1LL << 32), -256, -1, 0,
+                      1,           255,           1LL << 40,    INT64_MAX};
+  int count = sizeof(values) / sizeof(values[0]);
+  KeyBuilder previous;
+  for (int i = 0; i < count; i++) {
+    KeyBuilder key;
+    keyBegin(&key);
+    check(keyAddI64(&key, values[i]), "i64 fits", i);
+    check(i == 0 || compareEncoded(&previous, &key) < 0, "i64 order", i);
+
+    KeyReader reader;
+    int64_t read = 0;
+    keyReaderOpen(&reader, key.bytes, key.length);
+    check(keyReadI64(&reader, &read) && read == values[i], "i64 round trip",
+          i);
+    previous = key;
+  }
+}
+
+static void encodeDouble(KeyBuilder *key, double value) {
+  keyBegin(key);
+  keyAddDouble(key, value);
+}
+
+static void checkDouble() {
+  double values[] = {-INFINITY, -DBL_MAX, -1e300,  -1.5,   -1.0,
+                     -DBL_MIN,  -5e-324,  0.0,     5e-324, DBL_MIN,
+                     1.0,       1.5,      1e300,   DBL_MAX, INFINITY};
+  int count = sizeof(values) / sizeof(values[0]);
+  KeyBuilder previous;
+  for (int i = 0; i < count; i++) {
+    KeyBuilder key;
+    encodeDouble(&key, values[i]);
+    check(i == 0 || compareEncoded(&previous, &key) < 0, "double order", i);
+
+    KeyReader reader;
+    double read = 0;
+    keyReaderOpen(&reader, key.bytes, key.length);
+    check(keyReadDouble(&reader, &read) && read == values[i],
+          "double round trip", i);
+    previous = key;
+  }
+
+  // -0.0 is stored as 0.0
+  KeyBuilder zero;
+  KeyBuilder negativeZero;
+  encodeDouble(&zero, 0.0);
+  encodeDouble(&negativeZero, -0.0);
+  check(compareEncoded(&zero, &negativeZero) == 0, "-0.0 equals 0.0", 0);
+  KeyReader reader;
+  double read = -1;
+  keyReaderOpen(&reader, negativeZero.bytes, negativeZero.length);
+  check(keyReadDouble(&reader, &read) && read == 0.0 && !signbit(read),
+        "-0.0 reads back as 0.0", 0);
+
+  // Every NaN is the same one, after infinity
+  KeyBuilder nan;
+  KeyBuilder negativeNan;
+  KeyBuilder infinity;
+  encodeDouble(&nan, NAN);
+  encodeDouble(&negativeNan, -NAN);
+  encodeDouble(&infinity, INFINITY);
+  check(compareEncoded(&nan, &negativeNan) == 0, "NaNs are equal", 0);
+  check(compareEncoded(&infinity, &nan) < 0, "NaN after infinity", 0);
+  keyReaderOpen(&reader, nan.bytes, nan.length);
+  check(keyReadDouble(&reader, &read) && isnan(read), "NaN reads back", 0);
+}
+
+// Strings in ascending byte order, a string before the ones it starts
+static void checkString() {
+  TestString values[] = {{"", 0},       {"\0", 1},    {"\0\0", 2},
+                         {"\0\1", 2},   {"\0a", 2},   {"\1", 1},
+                         {"a", 1},      {"a\0", 2},   {"a\0\0", 3},
+                         {"a\0b", 3},   {"a\1", 2},   {"ab", 2},
+                         {"b", 1},      {"\xff", 1},  {"\xff\0", 2}};
+  int count = sizeof(values) / sizeof(values[0]);
+  KeyBuilder previous;
+  for (int i = 0; i < count; i++) {
+    KeyBuilder key;
+    keyBegin(&key);
+    check(keyAddString(&key, values[i].bytes, values[i].length),
+          "string fits", i);
+    check(i == 0 || compareEncoded(&previous, &key) < 0, "string order", i);
+
+    KeyReader reader;
+    char buffer[8];
+    uint16_t length = 0;
+    keyReaderOpen(&reader, key.bytes, key.length);
+    check(keyReadString(&reader, buffer, sizeof(buffer), &length) &&
+              length == values[i].length &&
+              memcmp(buffer, values[i].bytes, length) == 0 &&
+              reader.position == key.length,
+          "string round trip", i);
+    previous = key;
+  }
+
+  // The string part decides before the parts after it
+  for (int i = 1; i < count; i++) {
+    KeyBuilder smaller;
+    KeyBuilder larger;
+    keyBegin(&smaller);
+    keyAddString(&smaller, values[i - 1].bytes, values[i - 1].length);
+    keyAddU64(&smaller, UINT64_MAX);
+    keyBegin(&larger);
+    keyAddString(&larger, values[i].bytes, values[i].length);
+    keyAddU64(&larger, 0);
+    check(compareEncoded(&smaller, &larger) < 0, "string then u64 order", i);
+
+    KeyReader reader;
+    char buffer[8];
+    uint16_t length;
+    uint64_t number = 1;
+    keyReaderOpen(&reader, larger.bytes, larger.length);
+    check(keyReadString(&reader, buffer, sizeof(buffer), &length) &&
+              keyReadU64(&reader, &number) && number == 0,
+          "string then u64 round trip", i);
+  }
+
+  // A key built from the first parts of another is a prefix of it
+  KeyBuilder part;
+  KeyBuilder whole;
+  keyBegin(&part);
+  keyAddString(&part, "a\0b", 3);
+  whole = part;
+  keyAddI64(&whole, -1);
+  check(part.length < whole.length &&
+            memcmp(part.bytes, whole.bytes, part.length) == 0,
+        "parts are a prefix", 0);
+
+  // A malformed or oversized string is refused
+  KeyReader reader;
+  char buffer[1];
+  uint16_t length;
+  keyReaderOpen(&reader, "a\0", 2);
+  check(!keyReadString(&reader, buffer, sizeof(buffer), &length),
+        "unterminated string", 0);
+  keyReaderOpen(&reader, "ab\0\1", 4);
+  check(!keyReadString(&reader, buffer, sizeof(buffer), &length),
+        "string past the buffer", 0);
+  KeyBuilder full;
+  keyBegin(&full);
+  char zeros[BTREE_MAX_KEY_SIZE / 2] = {0};
+  check(!keyAddString(&full, zeros, sizeof(zeros)) && full.length == 0,
+        "escaped string past BTREE_MAX_KEY_SIZE", 0);
+}
+
+static int valueIs(BTree *tree, const char *key, uint16_t klen,
+                   const char *value) {
+  KeyValue found;
+  if (searchKeyBytes(tree, key, klen, &found) != 1) {
+    return 0;
+  }
+  int matches = found.vlen == strlen(value) &&
+                memcmp(found.value, value, found.vlen) == 0;
+  free(found.key);
+  free(found.value);
+  return matches;
+}
+
+// Keys differing only after a zero byte stay apart through every update
+static void checkKeyBytes() {
+  Storage *storage = storageOpen(NULL, STORAGE_MEMORY, 1);
+  BTree *tree = storage != NULL ? createTreeOn(storage, NULL) : NULL;
+  if (tree == NULL) {
+    check(0, "in-memory tree", 0);
+    return;
+  }
+
+  int64_t result = 0;
+  check(incrementKeyBytes(tree, "k\0a", 3, 5, &result) && result == 5,
+        "increment", 0);
+  check(incrementKeyBytes(tree, "k\0b", 3, -2, &result) && result == -2,
+        "increment", 1);
+  check(appendKeyBytes(tree, "k\0a", 3, "0", 1), "append", 0);
+  check(compareAndSwapKeyBytes(tree, "k\0b", 3, "-2", 2, "x", 1), "swap", 0);
+  check(!compareAndSwapKeyBytes(tree, "k\0b", 3, "-2", 2, "y", 1), "swap",
+        1);
+  check(appendValue(tree, "k", "z", 1), "append", 1);
+
+  check(valueIs(tree, "k\0a", 3, "50"), "value of k\\0a", 0);
+  check(valueIs(tree, "k\0b", 3, "x"), "value of k\\0b", 0);
+  check(valueIs(tree, "k", 1, "z"), "value of k", 0);
+  closeTree(tree);
+}
+
+// Length of the value of key i in the given round, 30% of them 2500 bytes
+static uint16_t mixedLength(uint32_t i, int round) {
+  uint32_t mix = (i * 2654435761u) >> 8;
+  mix += round * 7;
+  if (mix % 10 < 3) {
+    return 2500;
+  }
+  return mix % 10 < 6 ? 1000 : 1 + mix % 100;
+}
+
+static int mixedIs(BTree *tree, const char *key, uint16_t klen,
+                   uint16_t vlen, char fill) {
+  KeyValue found;
+  if (searchKeyBytes(tree, key, klen, &found) != 1) {
+    return 0;
+  }
+  int matches = found.vlen == vlen;
+  for (uint16_t j = 0; matches && j < vlen; j++) {
+    matches = found.value[j] == fill;
+  }
+  free(found.key);
+  free(found.value);
+  return matches;
+}
+
+/*
+Large and small values inserted in random order, then given other lengths,
+split nodes by their bytes. Every write goes through and reads back.
+*/
+static void checkMixedValues(int shadow) {
+  Storage *storage = storageOpen(NULL, STORAGE_MEMORY, 1);
+  BTree *tree = storage != NULL ? createTreeOn(storage, NULL) : NULL;
+  if (tree == NULL || (shadow && enableShadowPaging(tree) != 1)) {
+    check(0, "in-memory tree", shadow);
+    closeTree(tree);
+    return;
+  }
+
+  static char value[2500];
+  uint32_t count = 1500;
+  for (int round = 0; round < 2; round++) {
+    for (uint32_t n = 0; n < count; n++) {
+      // 7 and 1500 share no factor, so every key comes up once
+      uint32_t i = n * 7 % count;
+      char key[16];
+      uint16_t klen = snprintf(key, sizeof(key), "mixed%u", i);
+      uint16_t vlen = mixedLength(i, round);
+      memset(value, 'a' + (i + round) % 26, vlen);
+      KeyValue kv = {.klen = klen, .vlen = vlen, .key = key, .value = value};
+      check(insert(tree, kv) == 1, "mixed insert", i);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      char key[16];
+      uint16_t klen = snprintf(key, sizeof(key), "mixed%u", i);
+      check(mixedIs(tree, key, klen, mixedLength(i, round),
+                    'a' + (i + round) % 26),
+            shadow ? "mixed value, shadow paging" : "mixed value", i);
+    }
+  }
+
+  // A value past the limits is refused, not stored
+  char key[BTREE_MAX_KEY_SIZE] = {0};
+  static char large[BTREE_MAX_VAL_SIZE + 1];
+  KeyValue tooLarge = {.klen = sizeof(key),
+                       .vlen = sizeof(large),
+                       .key = key,
+                       .value = large};
+  check(insert(tree, tooLarge) == 0, "record past the limits", shadow);
+  closeTree(tree);
+}
+
+// Whether the value lookup finds exactly the klen bytes of key
+static int findsOnly(BTree *tree, const char *value, uint16_t vlen, int prefix,
+                     const char *key, uint16_t klen) {
+  KeyValue *keys = NULL;
+  int count = findKeysByValue(tree, value, vlen, prefix, &keys);
+  int matches = count == 1 && keys[0].klen == klen &&
+                memcmp(keys[0].key, key, klen) == 0;
+  for (int i = 0; i < count; i++) {
+    free(keys[i].key);
+  }
+  free(keys);
+  return matches;
+}
+
+/*
+Long keys with long values, and the longest keys with the longest values of
+zero bytes, which escaped take twice their length, all get an index entry
+and are found by their values.
+*/
+static void checkIndexedValues() {
+  Storage *storage = storageOpen(NULL, STORAGE_MEMORY, 1);
+  BTree *tree = storage != NULL ? createTreeOn(storage, NULL) : NULL;
+  if (tree == NULL || declareValueIndex(tree, 0) != 0) {
+    check(0, "indexed in-memory tree", 0);
+    closeTree(tree);
+    return;
+  }
+
+  static char key[BTREE_MAX_KEY_SIZE];
+  static char value[BTREE_MAX_VAL_SIZE];
+  struct {
+    uint16_t klen;
+    uint16_t vlen;
+    char fill;
+  } sizes[] = {{501, 504, 'v'}, {BTREE_MAX_KEY_SIZE, BTREE_MAX_VAL_SIZE, 0}};
+  uint32_t count = 20;
+  for (int size = 0; size < 2; size++) {
+    memset(key, 'k', sizes[size].klen);
+    memset(value, sizes[size].fill, sizes[size].vlen);
+    for (uint32_t i = 0; i < count; i++) {
+      key[0] = value[sizes[size].vlen - 1] = 'a' + size * count + i;
+      KeyValue kv = {.klen = sizes[size].klen,
+                     .vlen = sizes[size].vlen,
+                     .key = key,
+                     .value = value};
+      check(insert(tree, kv) == 1, "indexed insert", size * count + i);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      key[0] = value[sizes[size].vlen - 1] = 'a' + size * count + i;
+      check(findsOnly(tree, value, sizes[size].vlen, 0, key,
+                      sizes[size].klen),
+            "find by value", size * count + i);
+      check(findsOnly(tree, value, sizes[size].vlen, 1, key,
+                      sizes[size].klen),
+            "find by value prefix", size * count + i);
+    }
+  }
+  closeTree(tree);
+}
+
+/*
+Runs every check and prints the ones that failed.
+Returns 1 when all passed, 0 otherwise.
+*/
+int runSelfTest() {
+  failures = 0;
+  checkU64();
+  checkI64();
+  checkDouble();
+  checkString();
+  checkKeyBytes();
+  checkMixedValues(0);
+  checkMixedValues(1);
+  checkIndexedValues();
+  if (failures == 0) {
+    printf("Self test passed\n");
+  }
+  return failures == 0;
+}
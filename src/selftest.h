@@ -0,0 +1,11 @@
+#ifndef SELFTEST_H
+#define SELFTEST_H
+
+/*
+Checks that need no database file: the key encodings of keys.h, and on
+in-memory trees the length-taking updates and nodes splitting by bytes. Run
+by kvdb selftest and make check.
+*/
+int runSelfTest();
+
+#endif // SELFTEST_H
@@ -0,0 +1,401 @@
+#include "shadow.h"
+#include "btree.h"
+#include "latch.h"
+#include "storage.h"
+#include "utils.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void pageListPush(PageList *list, NodePointer page) {
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+    list->pages = realloc(list->pages, list->capacity * sizeof(NodePointer));
+    assert(list->pages != NULL);
+  }
+  list->pages[list->count++] = page;
+}
+
+static int pageListContains(PageList *list, NodePointer page) {
+  for (size_t i = 0; i < list->count; i++) {
+    if (list->pages[i] == page) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void publish(ShadowState *shadow, Storage *storage, NodePointer root,
+                    uint64_t generation) {
+  atomic_fetch_add(&shadow->sequence, 1);
+  atomic_store(&shadow->publishedStorage, storage);
+  atomic_store(&shadow->publishedRoot, root);
+  atomic_store(&shadow->publishedGeneration, generation);
+  atomic_fetch_add(&shadow->sequence, 1);
+}
+
+static void readPublished(ShadowState *shadow, Storage **storage,
+                          NodePointer *root, uint64_t *generation) {
+  for (;;) {
+    uint64_t before = atomic_load(&shadow->sequence);
+    if (before & 1) {
+      continue; // A commit is publishing
+    }
+    *storage = atomic_load(&shadow->publishedStorage);
+    *root = atomic_load(&shadow->publishedRoot);
+    *generation = atomic_load(&shadow->publishedGeneration);
+    if (atomic_load(&shadow->sequence) == before) {
+      return;
+    }
+  }
+}
+
+/*
+Turns on copy-on-write for the tree. The header records it, so every later
+open of the file keeps using it.
+Returns 1 on success, 0 on failure.
+*/
+int enableShadowPaging(BTree *tree) {
+  if (tree->shadow != NULL) {
+    return 1;
+  }
+  // Index maintenance spans several trees, which a commit can't publish
+  if (tree->indexCount > 0) {
+    printf("Shadow paging can't be used with secondary indexes\n");
+    return 0;
+  }
+
+  ShadowState *shadow = calloc(1, sizeof(ShadowState));
+  if (shadow == NULL) {
+    perror("Memory allocation failed");
+    return 0;
+  }
+
+  if (pthread_mutex_init(&shadow->writerLock, NULL) != 0) {
+    free(shadow);
+    return 0;
+  }
+
+  publish(shadow, tree->storage, tree->root, tree->generation);
+  tree->shadow = shadow;
+
+  if ((tree->flags & TREE_SHADOW_PAGING) == 0) {
+    tree->flags |= TREE_SHADOW_PAGING;
+    updateTreeInFile(tree);
+    if (storageSync(tree->storage) != 1) {
+      perror("Failed to sync the tree header");
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Publishes the root after another process moved it, see reloadTreeHeader
+void shadowPublish(BTree *tree) {
+  publish(tree->shadow, tree->storage, tree->root, tree->generation);
+}
+
+void shadowFree(ShadowState *shadow) {
+  if (shadow == NULL) {
+    return;
+  }
+  pthread_mutex_destroy(&shadow->writerLock);
+  free(shadow->fresh.pages);
+  free(shadow->retired.pages);
+  free(shadow->free.pages);
+  free(shadow->pending);
+  free(shadow);
+}
+
+/*
+Takes over the free list the last close saved. The listed pages are free
+right away. The pages of the chain are retired by the running transaction,
+they are only handed out once its commit no longer points the header at the
+chain.
+*/
+static void loadFreeList(BTree *tree) {
+  ShadowState *shadow = tree->shadow;
+  NodePointer page = tree->freeList;
+  uint64_t pages = tree->last / BTREE_PAGE_SIZE;
+  tree->freeList = 0;
+
+  unsigned char bytes[BTREE_PAGE_SIZE];
+  while (page != 0 && pages-- > 0) {
+    if (page % BTREE_PAGE_SIZE != 0 || page >= tree->last ||
+        storageRead(tree->storage, bytes, BTREE_PAGE_SIZE, page) !=
+            BTREE_PAGE_SIZE ||
+        bytesToUInt16(bytes, 8) > FREE_LIST_MAX) {
+      printf("The free list is corrupt, the rest of it is left alone\n");
+      return;
+    }
+
+    uint16_t count = bytesToUInt16(bytes, 8);
+    for (uint16_t i = 0; i < count; i++) {
+      NodePointer free = bytesToUInt64(bytes, FREE_LIST_HEADER + i * 8);
+      if (free % BTREE_PAGE_SIZE == 0 && free >= BTREE_PAGE_SIZE &&
+          free < tree->last) {
+        pageListPush(&shadow->free, free);
+      }
+    }
+    pageListPush(&shadow->retired, page);
+    page = bytesToUInt64(bytes, 0);
+  }
+}
+
+/*
+Starts a write transaction. Writers are serialized, readers are not affected.
+*/
+void shadowBegin(BTree *tree) {
+  ShadowState *shadow = tree->shadow;
+  pthread_mutex_lock(&shadow->writerLock);
+  shadow->fresh.count = 0;
+  shadow->retired.count = 0;
+  if (tree->freeList != 0) {
+    loadFreeList(tree);
+  }
+}
+
+void markPageFresh(BTree *tree, NodePointer page) {
+  pageListPush(&tree->shadow->fresh, page);
+}
+
+int takeFreePage(BTree *tree, NodePointer *page) {
+  PageList *free = &tree->shadow->free;
+  if (free->count == 0) {
+    return 0;
+  }
+  *page = free->pages[--free->count];
+  markPageFresh(tree, *page);
+  return 1;
+}
+
+/*
+Moves a node that is about to be modified to a new page, unless the running
+transaction already wrote it. The caller writes the node and points its
+parent at the new page.
+Returns 1 when the node was moved.
+*/
+int shadowNode(BTree *tree, Node *node) {
+  ShadowState *shadow = tree->shadow;
+  if (shadow == NULL || pageListContains(&shadow->fresh, node->self_pointer)) {
+    return 0;
+  }
+
+  pageListPush(&shadow->retired, node->self_pointer);
+  node->self_pointer = allocatePage(tree);
+  return 1;
+}
+
+// Hands out the replaced pages that no pinned snapshot can reach anymore
+static void reclaimPages(ShadowState *shadow) {
+  uint64_t oldestPinned = UINT64_MAX;
+  for (int i = 0; i < SHADOW_MAX_SNAPSHOTS; i++) {
+    uint64_t pin = atomic_load(&shadow->pins[i]);
+    if (pin != 0 && pin - 1 < oldestPinned) {
+      oldestPinned = pin - 1;
+    }
+  }
+
+  size_t kept = 0;
+  for (size_t i = 0; i < shadow->pendingCount; i++) {
+    RetiredPage retired = shadow->pending[i];
+    if (retired.generation <= oldestPinned) {
+      pageListPush(&shadow->free, retired.page);
+    } else {
+      shadow->pending[kept++] = retired;
+    }
+  }
+  shadow->pendingCount = kept;
+}
+
+/*
+Makes the pages written by the transaction durable, then switches the root in
+one header write and publishes the new generation to readers.
+*/
+int shadowCommit(BTree *tree) {
+  ShadowState *shadow = tree->shadow;
+
+  if (storageSync(tree->storage) != 1) {
+    perror("Failed to sync shadow pages");
+    pthread_mutex_unlock(&shadow->writerLock);
+    return 0;
+  }
+
+  tree->generation++;
+  updateTreeInFile(tree);
+  if (storageSync(tree->storage) != 1) {
+    perror("Failed to sync the tree header");
+    pthread_mutex_unlock(&shadow->writerLock);
+    return 0;
+  }
+
+  publish(shadow, tree->storage, tree->root, tree->generation);
+
+  size_t needed = shadow->pendingCount + shadow->retired.count;
+  if (needed > shadow->pendingCapacity) {
+    shadow->pendingCapacity = needed * 2;
+    shadow->pending =
+        realloc(shadow->pending, shadow->pendingCapacity * sizeof(RetiredPage));
+    assert(shadow->pending != NULL);
+  }
+  for (size_t i = 0; i < shadow->retired.count; i++) {
+    RetiredPage retired = {.page = shadow->retired.pages[i],
+                           .generation = tree->generation};
+    shadow->pending[shadow->pendingCount++] = retired;
+  }
+
+  reclaimPages(shadow);
+  pthread_mutex_unlock(&shadow->writerLock);
+  return 1;
+}
+
+/*
+Ends the transaction opened with shadowBegin after the tree was moved to a
+new file. Page numbers of the old file mean nothing there, so every list is
+dropped. Snapshots taken before keep reading the old file.
+*/
+void shadowReset(BTree *tree) {
+  ShadowState *shadow = tree->shadow;
+  shadow->fresh.count = 0;
+  shadow->retired.count = 0;
+  shadow->free.count = 0;
+  shadow->pendingCount = 0;
+  publish(shadow, tree->storage, tree->root, tree->generation);
+  pthread_mutex_unlock(&shadow->writerLock);
+}
+
+/*
+Saves the free pages, those waiting for readers included, in a chain of
+pages taken from the list itself and points the header at it, for the next
+open to reuse them. The tree is closing, so no snapshot is left. A free list
+the header still points at was never taken over, it is left as it is.
+Returns 1 on success, 0 on a write error. A crash loses the list, compaction
+gets its pages back.
+*/
+int shadowSaveFreeList(BTree *tree) {
+  ShadowState *shadow = tree->shadow;
+  if (tree->storage->kind == STORAGE_MEMORY || tree->freeList != 0) {
+    return 1;
+  }
+  for (size_t i = 0; i < shadow->pendingCount; i++) {
+    pageListPush(&shadow->free, shadow->pending[i].page);
+  }
+  shadow->pendingCount = 0;
+
+  PageList *free = &shadow->free;
+  if (free->count == 0) {
+    return 1;
+  }
+
+  unsigned char bytes[BTREE_PAGE_SIZE];
+  NodePointer next = 0;
+  while (free->count > 0) {
+    NodePointer page = free->pages[--free->count];
+    uint16_t count = free->count < FREE_LIST_MAX ? free->count : FREE_LIST_MAX;
+    free->count -= count;
+
+    memset(bytes, 0, BTREE_PAGE_SIZE);
+    uint64ToBytes(next, bytes, 0);
+    uint16ToBytes(count, bytes, 8);
+    for (uint16_t i = 0; i < count; i++) {
+      uint64ToBytes(free->pages[free->count + i], bytes,
+                    FREE_LIST_HEADER + i * 8);
+    }
+    if (storageWrite(tree->storage, bytes, BTREE_PAGE_SIZE, page) !=
+        BTREE_PAGE_SIZE) {
+      printf("Failed to write the free list\n");
+      return 0;
+    }
+    next = page;
+  }
+
+  if (storageSync(tree->storage) != 1) {
+    perror("Failed to sync the free list");
+    return 0;
+  }
+  tree->freeList = next;
+  updateTreeInFile(tree);
+  return storageSync(tree->storage);
+}
+
+/*
+Pins the published root. Pages reachable from it are not reused until the
+snapshot is released.
+Returns 1 on success, 0 when every snapshot slot is taken.
+*/
+int snapshotAcquire(BTree *tree, Snapshot *snapshot) {
+  ShadowState *shadow = tree->shadow;
+  Storage *storage;
+  NodePointer root;
+  uint64_t generation;
+  readPublished(shadow, &storage, &root, &generation);
+
+  int slot = -1;
+  for (int i = 0; i < SHADOW_MAX_SNAPSHOTS && slot == -1; i++) {
+    uint64_t expected = 0;
+    if (atomic_compare_exchange_strong(&shadow->pins[i], &expected,
+                                       generation + 1)) {
+      slot = i;
+    }
+  }
+  if (slot == -1) {
+    return 0;
+  }
+
+  // A commit may have reclaimed pages before it saw the pin, so only trust
+  // the pin once the published generation is confirmed after it
+  for (;;) {
+    atomic_store(&shadow->pins[slot], generation + 1);
+    if (atomic_load(&shadow->publishedGeneration) == generation) {
+      break;
+    }
+    readPublished(shadow, &storage, &root, &generation);
+  }
+
+  snapshot->storage = storage;
+  snapshot->root = root;
+  snapshot->generation = generation;
+  snapshot->slot = slot;
+  return 1;
+}
+
+int snapshotSearch(BTree *tree, Snapshot *snapshot, const char *key,
+                   uint16_t klen, KeyValue *foundKv) {
+  latchTouch(tree->latches, snapshot->root);
+  Node *currentNode = nodeFromFile(snapshot->storage, snapshot->root);
+
+  while (currentNode != NULL) {
+    int keyIndex = getKeyInNode(currentNode, key, klen);
+    if (keyIndex != -1 && isTombstone(currentNode->key_values[keyIndex])) {
+      freeNode(currentNode);
+      return -1;
+    }
+    if (keyIndex != -1) {
+      *foundKv = currentNode->key_values[keyIndex];
+      // The caller owns the key and value now
+      currentNode->key_values[keyIndex].key = NULL;
+      currentNode->key_values[keyIndex].value = NULL;
+      freeNode(currentNode);
+      return 1;
+    }
+
+    if (currentNode->header.type == LEAF) {
+      freeNode(currentNode);
+      return -1;
+    }
+
+    NodePointer next =
+        currentNode->pointers[getNextChild(currentNode, key, klen)];
+    freeNode(currentNode);
+    latchTouch(tree->latches, next);
+    currentNode = nodeFromFile(snapshot->storage, next);
+  }
+
+  return -1;
+}
+
+void snapshotRelease(BTree *tree, Snapshot *snapshot) {
+  atomic_store(&tree->shadow->pins[snapshot->slot], 0);
+}
@@ -0,0 +1,84 @@
+#ifndef SHADOW_H
+#define SHADOW_H
+
+#include "btree.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define SHADOW_MAX_SNAPSHOTS 64
+
+/*
+Free list saved by closeTree, a chain of pages, each
+| next | count |    pages   |
+|  8B  |  2B   | count * 8B |
+next is the following page of the chain, 0 on the last one.
+*/
+#define FREE_LIST_HEADER 10
+#define FREE_LIST_MAX ((BTREE_PAGE_SIZE - FREE_LIST_HEADER) / 8)
+
+/*
+A page that stopped being part of the tree at `generation`. Snapshots taken
+before that generation may still read it.
+*/
+typedef struct RetiredPage {
+  NodePointer page;
+  uint64_t generation;
+} RetiredPage;
+
+typedef struct PageList {
+  NodePointer *pages;
+  size_t count;
+  size_t capacity;
+} PageList;
+
+/*
+Copy-on-write state. A mutation never overwrites a page reachable from the
+published root: it writes new versions of the nodes on its path and publishes
+them with a single header write. Readers pin the published root and read
+without taking locks.
+*/
+typedef struct ShadowState {
+  pthread_mutex_t writerLock;
+
+  // Published version, read under a sequence lock
+  _Atomic uint64_t sequence;
+  _Atomic NodePointer publishedRoot;
+  _Atomic uint64_t publishedGeneration;
+  _Atomic(struct Storage *) publishedStorage; // Moves with compaction
+
+  // Pinned generation + 1 of each active snapshot, 0 for a free slot
+  _Atomic uint64_t pins[SHADOW_MAX_SNAPSHOTS];
+
+  PageList fresh;   // Pages written by the running transaction
+  PageList retired; // Pages the running transaction replaced
+  RetiredPage *pending; // Replaced pages waiting for their readers
+  size_t pendingCount;
+  size_t pendingCapacity;
+  PageList free; // Pages that can be handed out again
+} ShadowState;
+
+typedef struct Snapshot {
+  struct Storage *storage;
+  NodePointer root;
+  uint64_t generation;
+  int slot;
+} Snapshot;
+
+int enableShadowPaging(BTree *tree);
+void shadowFree(ShadowState *shadow);
+void shadowPublish(BTree *tree);
+int shadowSaveFreeList(BTree *tree);
+void shadowBegin(BTree *tree);
+int shadowCommit(BTree *tree);
+void shadowReset(BTree *tree);
+int shadowNode(BTree *tree, Node *node);
+void markPageFresh(BTree *tree, NodePointer page);
+int takeFreePage(BTree *tree, NodePointer *page);
+
+int snapshotAcquire(BTree *tree, Snapshot *snapshot);
+int snapshotSearch(BTree *tree, Snapshot *snapshot, const char *key,
+                   uint16_t klen, KeyValue *foundKv);
+void snapshotRelease(BTree *tree, Snapshot *snapshot);
+
+#endif // SHADOW_H
@@ -0,0 +1,347 @@
+#include "shard.h"
+#include "btree.h"
+#include "update.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static char *shardFileName(const char *directory, int index) {
+  size_t length = strlen(directory) + 32;
+  char *filename = malloc(length);
+  assert(filename != NULL);
+  snprintf(filename, length, SHARD_FILE_FORMAT, directory, index);
+  return filename;
+}
+
+static int countShardFiles(const char *directory) {
+  int count = 0;
+  while (count < SHARD_MAX) {
+    char *filename = shardFileName(directory, count);
+    int exists = access(filename, F_OK) == 0;
+    free(filename);
+    if (!exists) {
+      break;
+    }
+    count++;
+  }
+  return count;
+}
+
+static void shardWriteLock(Shard *shard);
+
+/*
+Opens the shards in directory, creating the directory and missing shards.
+With count 0 the shards already there are opened. A database can't be
+reopened with another count, keys would be looked up in the wrong shard.
+*/
+ShardedDB *shardedOpen(const char *directory, int count) {
+  if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+    perror("Failed to create the database directory");
+    return NULL;
+  }
+
+  int existing = countShardFiles(directory);
+  if (count == 0) {
+    count = existing;
+  }
+  if (count < 1 || count > SHARD_MAX) {
+    printf("A sharded database has 1 to %d shards\n", SHARD_MAX);
+    return NULL;
+  }
+  if (existing != 0 && existing != count) {
+    printf("%s has %d shards, not %d\n", directory, existing, count);
+    return NULL;
+  }
+
+  ShardedDB *db = malloc(sizeof(ShardedDB));
+  Shard *shards = calloc(count, sizeof(Shard));
+  if (db == NULL || shards == NULL) {
+    perror("Memory allocation failed");
+    free(db);
+    free(shards);
+    return NULL;
+  }
+  db->directory = strdup(directory);
+  db->count = 0;
+  db->shards = shards;
+
+  for (int i = 0; i < count; i++) {
+    char *filename = shardFileName(directory, i);
+    BTree *tree = existing == 0 ? createTree(filename)
+                                : treeFromFileName(filename);
+    free(filename);
+    if (tree == NULL) {
+      shardedClose(db);
+      return NULL;
+    }
+
+    shards[i].tree = tree;
+    pthread_rwlock_init(&shards[i].lock, NULL);
+    pthread_mutex_init(&shards[i].readersLock, NULL);
+    db->count++;
+  }
+
+  return db;
+}
+
+void shardedClose(ShardedDB *db) {
+  if (db == NULL) {
+    return;
+  }
+  for (int i = 0; i < db->count; i++) {
+    // Closing writes the hot page list and the header
+    shardWriteLock(&db->shards[i]);
+    closeTree(db->shards[i].tree); // Drops the flock with the file
+    pthread_rwlock_unlock(&db->shards[i].lock);
+    pthread_rwlock_destroy(&db->shards[i].lock);
+    pthread_mutex_destroy(&db->shards[i].readersLock);
+  }
+  free(db->shards);
+  free(db->directory);
+  free(db);
+}
+
+// FNV-1a, cheap and spreads similar keys over every shard
+int shardFor(ShardedDB *db, const char *key, uint16_t klen) {
+  uint64_t hash = FNV_OFFSET;
+  for (uint16_t i = 0; i < klen; i++) {
+    hash ^= (unsigned char)key[i];
+    hash *= FNV_PRIME;
+  }
+  return hash % db->count;
+}
+
+/*
+Takes the shard for reading. The first reader of the process takes the
+shared flock and picks up whatever other processes committed meanwhile.
+*/
+static void shardReadLock(Shard *shard) {
+  pthread_rwlock_rdlock(&shard->lock);
+  pthread_mutex_lock(&shard->readersLock);
+  if (shard->readers++ == 0) {
+    if (lockTree(shard->tree, LOCK_SH) != 1) {
+      perror("Failed to lock the shard");
+      exit(1);
+    }
+  }
+  pthread_mutex_unlock(&shard->readersLock);
+}
+
+static void shardReadUnlock(Shard *shard) {
+  pthread_mutex_lock(&shard->readersLock);
+  if (--shard->readers == 0) {
+    unlockTree(shard->tree);
+  }
+  pthread_mutex_unlock(&shard->readersLock);
+  pthread_rwlock_unlock(&shard->lock);
+}
+
+static void shardWriteLock(Shard *shard) {
+  pthread_rwlock_wrlock(&shard->lock);
+  if (lockTree(shard->tree, LOCK_EX) != 1) {
+    perror("Failed to lock the shard");
+    exit(1);
+  }
+}
+
+static void shardWriteUnlock(Shard *shard) {
+  unlockTree(shard->tree);
+  pthread_rwlock_unlock(&shard->lock);
+}
+
+// insert into the shard of kv's key, returning what insert does
+int shardedInsert(ShardedDB *db, KeyValue kv) {
+  Shard *shard = &db->shards[shardFor(db, kv.key, kv.klen)];
+  shardWriteLock(shard);
+  int result = insert(shard->tree, kv);
+  shardWriteUnlock(shard);
+  return result;
+}
+
+/*
+The atomic updates of update.h. The shard's flock keeps other processes out
+for the whole read-modify-write, the tree's latches other threads. Like
+there, the KeyBytes variants take keys of klen bytes and the others text
+keys.
+*/
+
+int shardedIncrementKeyBytes(ShardedDB *db, const char *key, uint16_t klen,
+                             int64_t delta, int64_t *result) {
+  Shard *shard = &db->shards[shardFor(db, key, klen)];
+  shardWriteLock(shard);
+  int ok = incrementKeyBytes(shard->tree, key, klen, delta, result);
+  shardWriteUnlock(shard);
+  return ok;
+}
+
+int shardedIncrement(ShardedDB *db, char *key, int64_t delta,
+                     int64_t *result) {
+  return shardedIncrementKeyBytes(db, key, strlen(key), delta, result);
+}
+
+int shardedCompareAndSwapKeyBytes(ShardedDB *db, const char *key,
+                                  uint16_t klen, const char *expected,
+                                  uint16_t expectedLength,
+                                  const char *desired,
+                                  uint16_t desiredLength) {
+  Shard *shard = &db->shards[shardFor(db, key, klen)];
+  shardWriteLock(shard);
+  int swapped = compareAndSwapKeyBytes(shard->tree, key, klen, expected,
+                                       expectedLength, desired, desiredLength);
+  shardWriteUnlock(shard);
+  return swapped;
+}
+
+int shardedCompareAndSwap(ShardedDB *db, char *key, const char *expected,
+                          uint16_t expectedLength, const char *desired,
+                          uint16_t desiredLength) {
+  return shardedCompareAndSwapKeyBytes(db, key, strlen(key), expected,
+                                       expectedLength, desired, desiredLength);
+}
+
+int shardedAppendKeyBytes(ShardedDB *db, const char *key, uint16_t klen,
+                          const char *suffix, uint16_t length) {
+  Shard *shard = &db->shards[shardFor(db, key, klen)];
+  shardWriteLock(shard);
+  int appended = appendKeyBytes(shard->tree, key, klen, suffix, length);
+  shardWriteUnlock(shard);
+  return appended;
+}
+
+int shardedAppend(ShardedDB *db, char *key, const char *suffix,
+                  uint16_t length) {
+  return shardedAppendKeyBytes(db, key, strlen(key), suffix, length);
+}
+
+int shardedSearchKeyBytes(ShardedDB *db, const char *key, uint16_t klen,
+                          KeyValue *foundKv) {
+  Shard *shard = &db->shards[shardFor(db, key, klen)];
+  shardReadLock(shard);
+  int found = searchKeyBytes(shard->tree, key, klen, foundKv);
+  shardReadUnlock(shard);
+  return found;
+}
+
+int shardedSearch(ShardedDB *db, char *key, KeyValue *foundKv) {
+  return shardedSearchKeyBytes(db, key, strlen(key), foundKv);
+}
+
+/*
+Looks up many keys, locking each shard once for all of its keys. Only the
+key and klen of keys[i] are read. results[i] is what searchKeyBytes returned
+for keys[i], found[i] is only set when it was found.
+*/
+void shardedMultiGet(ShardedDB *db, const KeyValue *keys, int count,
+                     KeyValue *found, int *results) {
+  int *owners = malloc(count * sizeof(int));
+  assert(owners != NULL);
+  for (int i = 0; i < count; i++) {
+    owners[i] = shardFor(db, keys[i].key, keys[i].klen);
+  }
+
+  for (int s = 0; s < db->count; s++) {
+    int locked = 0;
+    for (int i = 0; i < count; i++) {
+      if (owners[i] != s) {
+        continue;
+      }
+      if (!locked) {
+        shardReadLock(&db->shards[s]);
+        locked = 1;
+      }
+      results[i] = searchKeyBytes(db->shards[s].tree, keys[i].key,
+                                  keys[i].klen, &found[i]);
+    }
+    if (locked) {
+      shardReadUnlock(&db->shards[s]);
+    }
+  }
+
+  free(owners);
+}
+
+static int shardedCursorAdvance(ShardedCursor *cursor, int shard) {
+  int status = cursorNext(cursor->cursors[shard], &cursor->heads[shard]);
+  cursor->live[shard] = status == 1;
+  return status;
+}
+
+ShardedCursor *shardedCursorOpen(ShardedDB *db) {
+  ShardedCursor *cursor = calloc(1, sizeof(ShardedCursor));
+  if (cursor == NULL) {
+    perror("Memory allocation failed");
+    return NULL;
+  }
+  cursor->db = db;
+  cursor->yielded = -1;
+  cursor->cursors = calloc(db->count, sizeof(Cursor *));
+  cursor->heads = calloc(db->count, sizeof(KeyValue));
+  cursor->live = calloc(db->count, sizeof(int));
+  assert(cursor->cursors != NULL && cursor->heads != NULL &&
+         cursor->live != NULL);
+
+  for (int i = 0; i < db->count; i++) {
+    shardReadLock(&db->shards[i]);
+    cursor->locked++;
+    cursor->cursors[i] = cursorOpen(db->shards[i].tree);
+    if (cursor->cursors[i] == NULL || shardedCursorAdvance(cursor, i) == -1) {
+      shardedCursorClose(cursor);
+      return NULL;
+    }
+  }
+  return cursor;
+}
+
+/*
+Yields the next key-value in key order across all shards, with the same
+lifetime rules as cursorNext.
+Returns 1 when a key-value was produced, 0 at the end and -1 on a read
+error.
+*/
+int shardedCursorNext(ShardedCursor *cursor, KeyValue *kv) {
+  // The shard yielded last only moves now, its head had to stay valid
+  if (cursor->yielded != -1 &&
+      shardedCursorAdvance(cursor, cursor->yielded) == -1) {
+    return -1;
+  }
+
+  int smallest = -1;
+  for (int i = 0; i < cursor->db->count; i++) {
+    if (cursor->live[i] &&
+        (smallest == -1 || compareKeyBytes(cursor->heads[i].key,
+                                           cursor->heads[i].klen,
+                                           cursor->heads[smallest]) < 0)) {
+      smallest = i;
+    }
+  }
+
+  cursor->yielded = smallest;
+  if (smallest == -1) {
+    return 0;
+  }
+  *kv = cursor->heads[smallest];
+  return 1;
+}
+
+void shardedCursorClose(ShardedCursor *cursor) {
+  if (cursor == NULL) {
+    return;
+  }
+  for (int i = 0; i < cursor->locked; i++) {
+    cursorClose(cursor->cursors[i]);
+    shardReadUnlock(&cursor->db->shards[i]);
+  }
+  free(cursor->cursors);
+  free(cursor->heads);
+  free(cursor->live);
+  free(cursor);
+}
@@ -0,0 +1,77 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "btree.h"
+#include <pthread.h>
+
+#define SHARD_MAX 256
+#define SHARD_FILE_FORMAT "%s/shard-%03d.db"
+
+/*
+One B-tree file of a sharded database. Processes sharing the directory
+exclude each other with flock on the shard file; threads of one process go
+through `lock` first, because flock is held per open file and not per
+thread.
+*/
+typedef struct Shard {
+  BTree *tree;
+  pthread_rwlock_t lock;
+  pthread_mutex_t readersLock;
+  int readers; // Threads of this process holding the shared flock
+} Shard;
+
+/*
+A directory of independent trees. Every key lives in the shard picked by a
+hash of the key, so writers to different shards never touch the same root or
+header.
+*/
+typedef struct ShardedDB {
+  char *directory;
+  int count;
+  Shard *shards;
+} ShardedDB;
+
+/*
+Ordered scan over every shard, merging one cursor per shard. Each shard stays
+read locked until the cursor is closed.
+*/
+typedef struct ShardedCursor {
+  ShardedDB *db;
+  Cursor **cursors;
+  KeyValue *heads;
+  int *live;   // Whether heads[i] holds the next key-value of shard i
+  int yielded; // Shard whose head was returned last, advanced on the next call
+  int locked;  // Shards read locked so far
+} ShardedCursor;
+
+ShardedDB *shardedOpen(const char *directory, int count);
+void shardedClose(ShardedDB *db);
+int shardFor(ShardedDB *db, const char *key, uint16_t klen);
+int shardedInsert(ShardedDB *db, KeyValue kv);
+int shardedIncrement(ShardedDB *db, char *key, int64_t delta,
+                     int64_t *result);
+int shardedIncrementKeyBytes(ShardedDB *db, const char *key, uint16_t klen,
+                             int64_t delta, int64_t *result);
+int shardedCompareAndSwap(ShardedDB *db, char *key, const char *expected,
+                          uint16_t expectedLength, const char *desired,
+                          uint16_t desiredLength);
+int shardedCompareAndSwapKeyBytes(ShardedDB *db, const char *key,
+                                  uint16_t klen, const char *expected,
+                                  uint16_t expectedLength,
+                                  const char *desired,
+                                  uint16_t desiredLength);
+int shardedAppend(ShardedDB *db, char *key, const char *suffix,
+                  uint16_t length);
+int shardedAppendKeyBytes(ShardedDB *db, const char *key, uint16_t klen,
+                          const char *suffix, uint16_t length);
+int shardedSearch(ShardedDB *db, char *key, KeyValue *foundKv);
+int shardedSearchKeyBytes(ShardedDB *db, const char *key, uint16_t klen,
+                          KeyValue *foundKv);
+void shardedMultiGet(ShardedDB *db, const KeyValue *keys, int count,
+                     KeyValue *found, int *results);
+
+ShardedCursor *shardedCursorOpen(ShardedDB *db);
+int shardedCursorNext(ShardedCursor *cursor, KeyValue *kv);
+void shardedCursorClose(ShardedCursor *cursor);
+
+#endif // SHARD_H
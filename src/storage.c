@@ -0,0 +1,388 @@
+#include "storage.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void storageGrowSize(Storage *storage, uint64_t end) {
+  uint64_t size = atomic_load(&storage->size);
+  while (size < end &&
+         !atomic_compare_exchange_weak(&storage->size, &size, end)) {
+  }
+}
+
+// File backend, positioned I/O on the descriptor
+
+static ssize_t fileRead(Storage *storage, void *buffer, size_t length,
+                        uint64_t offset) {
+  return pread(storage->fd, buffer, length, offset);
+}
+
+static ssize_t fileWrite(Storage *storage, const void *buffer, size_t length,
+                         uint64_t offset) {
+  return pwrite(storage->fd, buffer, length, offset);
+}
+
+static int fileAllocate(Storage *storage, uint64_t end) {
+  return 1; // Writes past the end grow the file
+}
+
+static int fileSync(Storage *storage) { return fdatasync(storage->fd) == 0; }
+
+static void filePrefetch(Storage *storage, uint64_t offset, size_t length) {
+  posix_fadvise(storage->fd, offset, length, POSIX_FADV_WILLNEED);
+}
+
+static int fileLock(Storage *storage, int operation) {
+  return flock(storage->fd, operation) == 0;
+}
+
+static void fileClose(Storage *storage) { close(storage->fd); }
+
+static const StorageOps fileOps = {.read = fileRead,
+                                   .write = fileWrite,
+                                   .allocate = fileAllocate,
+                                   .sync = fileSync,
+                                   .prefetch = filePrefetch,
+                                   .lock = fileLock,
+                                   .close = fileClose};
+
+/*
+mmap backend. The whole reserve is mapped once and the file is grown under
+it, so the mapping never moves while readers copy from it. Nothing past the
+end of the file is touched, that would fault.
+*/
+
+/*
+Picks up growth by other processes sharing the file, the cached size only
+follows this one's writes. Files don't shrink under an open tree, compaction
+moves a new file into place instead.
+Returns the size now known.
+*/
+static uint64_t mmapRefreshSize(Storage *storage) {
+  struct stat status;
+  if (fstat(storage->fd, &status) == 0) {
+    uint64_t size = status.st_size;
+    storageGrowSize(storage, size < STORAGE_MMAP_RESERVE
+                                 ? size
+                                 : STORAGE_MMAP_RESERVE);
+  }
+  return atomic_load(&storage->size);
+}
+
+static ssize_t mmapRead(Storage *storage, void *buffer, size_t length,
+                        uint64_t offset) {
+  uint64_t size = atomic_load(&storage->size);
+  if (offset + length > size) {
+    size = mmapRefreshSize(storage);
+  }
+  if (offset >= size) {
+    return 0;
+  }
+  if (offset + length > size) {
+    length = size - offset;
+  }
+  memcpy(buffer, storage->map + offset, length);
+  return length;
+}
+
+static int mmapAllocate(Storage *storage, uint64_t end) {
+  if (end <= atomic_load(&storage->size)) {
+    return 1;
+  }
+  if (end > STORAGE_MMAP_RESERVE) {
+    printf("The mapping is full\n");
+    return 0;
+  }
+
+  // Truncating to a size another process already grew past would cut its
+  // pages off
+  pthread_mutex_lock(&storage->growLock);
+  int ok = 1;
+  uint64_t size = mmapRefreshSize(storage);
+  if (end > size) {
+    uint64_t grown = (end + STORAGE_GROW_SIZE - 1) / STORAGE_GROW_SIZE *
+                     STORAGE_GROW_SIZE;
+    ok = ftruncate(storage->fd, grown) == 0;
+    if (ok) {
+      atomic_store(&storage->size, grown);
+    } else {
+      perror("Failed to grow the mapped file");
+    }
+  }
+  pthread_mutex_unlock(&storage->growLock);
+  return ok;
+}
+
+static ssize_t mmapWrite(Storage *storage, const void *buffer, size_t length,
+                         uint64_t offset) {
+  if (mmapAllocate(storage, offset + length) != 1) {
+    return -1;
+  }
+  memcpy(storage->map + offset, buffer, length);
+  return length;
+}
+
+static int mmapSync(Storage *storage) {
+  return msync(storage->map, atomic_load(&storage->size), MS_SYNC) == 0;
+}
+
+static void mmapPrefetch(Storage *storage, uint64_t offset, size_t length) {
+  uint64_t size = atomic_load(&storage->size);
+  if (offset < size) {
+    madvise(storage->map + offset,
+            offset + length > size ? size - offset : length, MADV_WILLNEED);
+  }
+}
+
+static void mmapClose(Storage *storage) {
+  munmap(storage->map, STORAGE_MMAP_RESERVE);
+  close(storage->fd);
+}
+
+static const StorageOps mmapOps = {.read = mmapRead,
+                                   .write = mmapWrite,
+                                   .allocate = mmapAllocate,
+                                   .sync = mmapSync,
+                                   .prefetch = mmapPrefetch,
+                                   .lock = fileLock,
+                                   .close = mmapClose};
+
+/*
+Memory backend, no system calls once a block exists. Blocks are allocated
+the first time they are written and never move.
+*/
+
+static char *memoryBlock(Storage *storage, uint64_t index, int create) {
+  char *block = atomic_load(&storage->blocks[index]);
+  if (block != NULL || !create) {
+    return block;
+  }
+
+  pthread_mutex_lock(&storage->growLock);
+  block = atomic_load(&storage->blocks[index]);
+  if (block == NULL) {
+    block = calloc(1, STORAGE_BLOCK_SIZE);
+    assert(block != NULL);
+    atomic_store(&storage->blocks[index], block);
+  }
+  pthread_mutex_unlock(&storage->growLock);
+  return block;
+}
+
+static ssize_t memoryRead(Storage *storage, void *buffer, size_t length,
+                          uint64_t offset) {
+  uint64_t size = atomic_load(&storage->size);
+  if (offset >= size) {
+    return 0;
+  }
+  if (offset + length > size) {
+    length = size - offset;
+  }
+
+  size_t done = 0;
+  while (done < length) {
+    uint64_t position = offset + done;
+    size_t within = position % STORAGE_BLOCK_SIZE;
+    size_t piece = STORAGE_BLOCK_SIZE - within;
+    if (piece > length - done) {
+      piece = length - done;
+    }
+    char *block = memoryBlock(storage, position / STORAGE_BLOCK_SIZE, 0);
+    if (block == NULL) {
+      memset((char *)buffer + done, 0, piece);
+    } else {
+      memcpy((char *)buffer + done, block + within, piece);
+    }
+    done += piece;
+  }
+  return length;
+}
+
+static int memoryAllocate(Storage *storage, uint64_t end) {
+  if (end > (uint64_t)STORAGE_MEMORY_BLOCKS * STORAGE_BLOCK_SIZE) {
+    printf("The in-memory storage is full\n");
+    return 0;
+  }
+  return 1;
+}
+
+static ssize_t memoryWrite(Storage *storage, const void *buffer, size_t length,
+                           uint64_t offset) {
+  if (memoryAllocate(storage, offset + length) != 1) {
+    return -1;
+  }
+
+  size_t done = 0;
+  while (done < length) {
+    uint64_t position = offset + done;
+    size_t within = position % STORAGE_BLOCK_SIZE;
+    size_t piece = STORAGE_BLOCK_SIZE - within;
+    if (piece > length - done) {
+      piece = length - done;
+    }
+    char *block = memoryBlock(storage, position / STORAGE_BLOCK_SIZE, 1);
+    memcpy(block + within, (const char *)buffer + done, piece);
+    done += piece;
+  }
+
+  storageGrowSize(storage, offset + length);
+  return length;
+}
+
+static int memorySync(Storage *storage) { return 1; }
+
+static void memoryPrefetch(Storage *storage, uint64_t offset, size_t length) {}
+
+static int memoryLock(Storage *storage, int operation) {
+  return 1; // Nobody outside this process can see it
+}
+
+static void memoryClose(Storage *storage) {
+  for (int i = 0; i < STORAGE_MEMORY_BLOCKS; i++) {
+    free(atomic_load(&storage->blocks[i]));
+  }
+  free(storage->blocks);
+}
+
+static const StorageOps memoryOps = {.read = memoryRead,
+                                     .write = memoryWrite,
+                                     .allocate = memoryAllocate,
+                                     .sync = memorySync,
+                                     .prefetch = memoryPrefetch,
+                                     .lock = memoryLock,
+                                     .close = memoryClose};
+
+static int storageMap(Storage *storage) {
+  struct stat status;
+  if (fstat(storage->fd, &status) != 0) {
+    perror("Failed to stat the database file");
+    return 0;
+  }
+  atomic_store(&storage->size, status.st_size);
+
+  storage->map = mmap(NULL, STORAGE_MMAP_RESERVE, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_NORESERVE, storage->fd, 0);
+  if (storage->map == MAP_FAILED) {
+    perror("Failed to map the database file");
+    return 0;
+  }
+  return 1;
+}
+
+/*
+Opens the storage of a tree. With create set the file is created or
+truncated, otherwise it must exist. Memory storage takes no filename and is
+always new.
+*/
+Storage *storageOpen(const char *filename, StorageKind kind, int create) {
+  if (kind == STORAGE_MEMORY && !create) {
+    printf("In-memory storage can't be reopened\n");
+    return NULL;
+  }
+
+  Storage *storage = calloc(1, sizeof(Storage));
+  if (storage == NULL) {
+    perror("Memory allocation failed");
+    return NULL;
+  }
+  storage->kind = kind;
+  storage->fd = -1;
+  pthread_mutex_init(&storage->growLock, NULL);
+
+  if (kind == STORAGE_MEMORY) {
+    storage->ops = &memoryOps;
+    storage->blocks = calloc(STORAGE_MEMORY_BLOCKS, sizeof(char *));
+    if (storage->blocks == NULL) {
+      perror("Memory allocation failed");
+      free(storage);
+      return NULL;
+    }
+    return storage;
+  }
+
+  storage->ops = kind == STORAGE_MMAP ? &mmapOps : &fileOps;
+  storage->fd = create ? open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644)
+                       : open(filename, O_RDWR);
+  if (storage->fd == -1) {
+    perror("Failed to open the database file");
+    free(storage);
+    return NULL;
+  }
+
+  if (kind == STORAGE_MMAP && storageMap(storage) != 1) {
+    close(storage->fd);
+    free(storage);
+    return NULL;
+  }
+  return storage;
+}
+
+// Parses the names used by KVDB_STORAGE
+int storageKindFromName(const char *name, StorageKind *kind) {
+  if (strcmp(name, "file") == 0) {
+    *kind = STORAGE_FILE;
+  } else if (strcmp(name, "mmap") == 0) {
+    *kind = STORAGE_MMAP;
+  } else if (strcmp(name, "memory") == 0) {
+    *kind = STORAGE_MEMORY;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+ssize_t storageRead(Storage *storage, void *buffer, size_t length,
+                    uint64_t offset) {
+  return storage->ops->read(storage, buffer, length, offset);
+}
+
+ssize_t storageWrite(Storage *storage, const void *buffer, size_t length,
+                     uint64_t offset) {
+  return storage->ops->write(storage, buffer, length, offset);
+}
+
+int storageAllocate(Storage *storage, uint64_t end) {
+  return storage->ops->allocate(storage, end);
+}
+
+int storageSync(Storage *storage) { return storage->ops->sync(storage); }
+
+void storagePrefetch(Storage *storage, uint64_t offset, size_t length) {
+  storage->ops->prefetch(storage, offset, length);
+}
+
+int storageLock(Storage *storage, int operation) {
+  return storage->ops->lock(storage, operation);
+}
+
+/*
+Whether filename names another file than the one the storage has open, as
+after a compaction moved a new file over it. Memory storage is never
+replaced.
+*/
+int storageReplaced(Storage *storage, const char *filename) {
+  if (storage->kind == STORAGE_MEMORY) {
+    return 0;
+  }
+  struct stat opened;
+  struct stat named;
+  if (fstat(storage->fd, &opened) != 0 || stat(filename, &named) != 0) {
+    return 0; // Reopening would fail the same way
+  }
+  return opened.st_dev != named.st_dev || opened.st_ino != named.st_ino;
+}
+
+void storageClose(Storage *storage) {
+  if (storage == NULL) {
+    return;
+  }
+  storage->ops->close(storage);
+  pthread_mutex_destroy(&storage->growLock);
+  free(storage);
+}
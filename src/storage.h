@@ -0,0 +1,69 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define STORAGE_MMAP_RESERVE (1ULL << 36) // Address space kept for a mapping
+#define STORAGE_GROW_SIZE (1 << 20)       // Mapped files grow by this much
+#define STORAGE_BLOCK_SIZE (1 << 20)
+#define STORAGE_MEMORY_BLOCKS 65536
+
+typedef enum StorageKind {
+  STORAGE_FILE,
+  STORAGE_MMAP,
+  STORAGE_MEMORY
+} StorageKind;
+
+typedef struct Storage Storage;
+
+/*
+What a backend implements. Offsets are bytes from the start of the storage,
+reads and writes behave like pread and pwrite.
+*/
+typedef struct StorageOps {
+  ssize_t (*read)(Storage *storage, void *buffer, size_t length,
+                  uint64_t offset);
+  ssize_t (*write)(Storage *storage, const void *buffer, size_t length,
+                   uint64_t offset);
+  int (*allocate)(Storage *storage, uint64_t end); // Make [0, end) writable
+  int (*sync)(Storage *storage);
+  void (*prefetch)(Storage *storage, uint64_t offset, size_t length);
+  int (*lock)(Storage *storage, int operation); // flock operations
+  void (*close)(Storage *storage);
+} StorageOps;
+
+/*
+Where the pages of a tree live: a file read with positioned I/O, a file
+mapped into memory, or memory only, gone once closed. Every backend can be
+used by many threads at once and never moves data that was handed out, so
+optimistic readers can copy pages while the storage grows.
+*/
+struct Storage {
+  const StorageOps *ops;
+  StorageKind kind;
+  int fd; // -1 for memory
+  _Atomic uint64_t size;
+  char *map;                   // Mapping of the file, mmap only
+  _Atomic(char *) *blocks;     // Fixed size blocks, memory only
+  pthread_mutex_t growLock;
+};
+
+Storage *storageOpen(const char *filename, StorageKind kind, int create);
+int storageKindFromName(const char *name, StorageKind *kind);
+
+ssize_t storageRead(Storage *storage, void *buffer, size_t length,
+                    uint64_t offset);
+ssize_t storageWrite(Storage *storage, const void *buffer, size_t length,
+                     uint64_t offset);
+int storageAllocate(Storage *storage, uint64_t end);
+int storageSync(Storage *storage);
+void storagePrefetch(Storage *storage, uint64_t offset, size_t length);
+int storageLock(Storage *storage, int operation);
+int storageReplaced(Storage *storage, const char *filename);
+void storageClose(Storage *storage);
+
+#endif // STORAGE_H
@@ -0,0 +1,174 @@
+#include "update.h"
+#include "btree.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INTEGER_DIGITS 20 // "-9223372036854775808"
+
+typedef struct Increment {
+  int64_t delta;
+  int64_t result;
+  int invalid; // The value isn't an integer or the sum overflows
+  char digits[INTEGER_DIGITS + 1];
+} Increment;
+
+// Parses a value made of an optional minus sign and decimal digits only
+static int parseInteger(const char *bytes, uint16_t length, int64_t *number) {
+  if (length == 0 || length > INTEGER_DIGITS) {
+    return 0;
+  }
+  char text[INTEGER_DIGITS + 1];
+  memcpy(text, bytes, length);
+  text[length] = '\0';
+  if (text[0] != '-' && (text[0] < '0' || text[0] > '9')) {
+    return 0;
+  }
+
+  char *end;
+  errno = 0;
+  long long parsed = strtoll(text, &end, 10);
+  if (errno != 0 || *end != '\0' || end == text) {
+    return 0;
+  }
+  *number = parsed;
+  return 1;
+}
+
+static int incrementUpdate(void *context, const KeyValue *current,
+                           KeyValue *updated) {
+  Increment *increment = context;
+  int64_t number = 0;
+  if (current != NULL &&
+      !parseInteger(current->value, current->vlen, &number)) {
+    increment->invalid = 1;
+    return 0;
+  }
+  if (__builtin_add_overflow(number, increment->delta, &increment->result)) {
+    increment->invalid = 1;
+    return 0;
+  }
+
+  updated->vlen = snprintf(increment->digits, sizeof(increment->digits),
+                           "%" PRId64, increment->result);
+  updated->value = increment->digits;
+  return 1;
+}
+
+/*
+Adds delta to the decimal integer stored under key, a missing key counts as
+0. The result is stored in result when it is not NULL.
+Returns 1 on success, 0 when the value is not an integer or the sum would
+overflow.
+*/
+int incrementKeyBytes(BTree *tree, const char *key, uint16_t klen,
+                      int64_t delta, int64_t *result) {
+  Increment increment = {.delta = delta};
+  if (updateKeyBytes(tree, key, klen, incrementUpdate, &increment) != 1) {
+    return 0;
+  }
+  if (result != NULL) {
+    *result = increment.result;
+  }
+  return 1;
+}
+
+int incrementValue(BTree *tree, char *key, int64_t delta, int64_t *result) {
+  return incrementKeyBytes(tree, key, strlen(key), delta, result);
+}
+
+typedef struct CompareAndSwap {
+  const char *expected; // NULL when the key must be missing
+  uint16_t expectedLength;
+  const char *desired; // NULL deletes the key
+  uint16_t desiredLength;
+} CompareAndSwap;
+
+static int compareAndSwapUpdate(void *context, const KeyValue *current,
+                                KeyValue *updated) {
+  CompareAndSwap *swap = context;
+  if (swap->expected == NULL) {
+    if (current != NULL) {
+      return 0;
+    }
+  } else if (current == NULL || current->vlen != swap->expectedLength ||
+             memcmp(current->value, swap->expected, swap->expectedLength) !=
+                 0) {
+    return 0;
+  }
+
+  updated->value = (char *)swap->desired;
+  updated->vlen = swap->desired != NULL ? swap->desiredLength : TOMBSTONE;
+  return 1;
+}
+
+/*
+Sets the value of key to desired only when it currently is expected. A NULL
+expected means the key must be missing, a NULL desired deletes the key.
+Returns 1 when the value was swapped, 0 when it didn't match or there was
+nothing to delete.
+*/
+int compareAndSwapKeyBytes(BTree *tree, const char *key, uint16_t klen,
+                           const char *expected, uint16_t expectedLength,
+                           const char *desired, uint16_t desiredLength) {
+  CompareAndSwap swap = {.expected = expected,
+                         .expectedLength = expectedLength,
+                         .desired = desired,
+                         .desiredLength = desiredLength};
+  return updateKeyBytes(tree, key, klen, compareAndSwapUpdate, &swap);
+}
+
+int compareAndSwapValue(BTree *tree, char *key, const char *expected,
+                        uint16_t expectedLength, const char *desired,
+                        uint16_t desiredLength) {
+  return compareAndSwapKeyBytes(tree, key, strlen(key), expected,
+                                expectedLength, desired, desiredLength);
+}
+
+typedef struct Append {
+  const char *suffix;
+  uint16_t length;
+  char *joined;
+} Append;
+
+static int appendUpdate(void *context, const KeyValue *current,
+                        KeyValue *updated) {
+  Append *append = context;
+  uint16_t vlen = current != NULL ? current->vlen : 0;
+  if (vlen + append->length > BTREE_MAX_VAL_SIZE) {
+    return 0;
+  }
+
+  free(append->joined);
+  append->joined = malloc(vlen + append->length);
+  if (append->joined == NULL) {
+    perror("Memory allocation failed");
+    return 0;
+  }
+  if (vlen > 0) {
+    memcpy(append->joined, current->value, vlen);
+  }
+  memcpy(append->joined + vlen, append->suffix, append->length);
+
+  updated->value = append->joined;
+  updated->vlen = vlen + append->length;
+  return 1;
+}
+
+/*
+Appends suffix to the value of key, a missing key starts out empty.
+Returns 1 on success, 0 when the value would grow past BTREE_MAX_VAL_SIZE.
+*/
+int appendKeyBytes(BTree *tree, const char *key, uint16_t klen,
+                   const char *suffix, uint16_t length) {
+  Append append = {.suffix = suffix, .length = length, .joined = NULL};
+  int appended = updateKeyBytes(tree, key, klen, appendUpdate, &append);
+  free(append.joined);
+  return appended;
+}
+
+int appendValue(BTree *tree, char *key, const char *suffix, uint16_t length) {
+  return appendKeyBytes(tree, key, strlen(key), suffix, length);
+}
@@ -0,0 +1,28 @@
+#ifndef UPDATE_H
+#define UPDATE_H
+
+#include "btree.h"
+#include <stdint.h>
+
+/*
+Read-modify-write operations on a single key. Each one is one descent of the
+tree through updateKeyBytes, the new value is computed with the node holding
+the key latched, so concurrent writers of the same key never lose updates.
+The KeyBytes variants take keys of klen bytes, which may hold zero bytes,
+the others text keys.
+*/
+
+int incrementValue(BTree *tree, char *key, int64_t delta, int64_t *result);
+int incrementKeyBytes(BTree *tree, const char *key, uint16_t klen,
+                      int64_t delta, int64_t *result);
+int compareAndSwapValue(BTree *tree, char *key, const char *expected,
+                        uint16_t expectedLength, const char *desired,
+                        uint16_t desiredLength);
+int compareAndSwapKeyBytes(BTree *tree, const char *key, uint16_t klen,
+                           const char *expected, uint16_t expectedLength,
+                           const char *desired, uint16_t desiredLength);
+int appendValue(BTree *tree, char *key, const char *suffix, uint16_t length);
+int appendKeyBytes(BTree *tree, const char *key, uint16_t klen,
+                   const char *suffix, uint16_t length);
+
+#endif // UPDATE_H
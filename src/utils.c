@@ -9,6 +9,16 @@ uint16_t bytesToUInt16(unsigned char *byteArray, int startIndex) {
   return result;
 }
 
+uint32_t bytesToUInt32(unsigned char *byteArray, int startIndex) {
+  uint32_t result = 0;
+
+  for (int i = 0; i < 4; i++) {
+    result = (result << 8) | byteArray[startIndex + i];
+  }
+
+  return result;
+}
+
 uint64_t bytesToUInt64(unsigned char *byteArray, int startIndex) {
   uint64_t result = 0;
 
@@ -24,6 +34,13 @@ void uint16ToBytes(uint16_t value, unsigned char *byteArray, int startIndex) {
   byteArray[startIndex + 1] = value & 0xFF;
 }
 
+void uint32ToBytes(uint32_t value, unsigned char *byteArray, int startIndex) {
+  for (int i = 3; i >= 0; i--) {
+    byteArray[startIndex + i] = value & 0xFF;
+    value >>= 8;
+  }
+}
+
 void uint64ToBytes(uint64_t value, unsigned char *byteArray, int startIndex) {
   for (int i = 7; i >= 0; i--) {
     byteArray[startIndex + i] = value & 0xFF;
@@ -39,6 +56,16 @@ void uintToBytes(uintmax_t value, unsigned char *byteArray, int startIndex,
   }
 }
 
+// FNV-1a, enough to catch torn or foreign headers
+uint32_t checksumBytes(unsigned char *bytes, size_t length) {
+  uint32_t hash = 0x811c9dc5;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= 0x01000193;
+  }
+  return hash;
+}
+
 char *charArrayToString(char *arr, uint16_t len) {
   char *result = malloc(sizeof(char) * (len + 1));
   memcpy(result, arr, len);
@@ -1,10 +1,13 @@
 #include <stdint.h>
 #include <stdlib.h>
 uint16_t bytesToUInt16(unsigned char *byteArray, int startIndex);
+uint32_t bytesToUInt32(unsigned char *byteArray, int startIndex);
 uint64_t bytesToUInt64(unsigned char *byteArray, int startIndex);
 void uint16ToBytes(uint16_t value, unsigned char *byteArray, int startIndex);
+void uint32ToBytes(uint32_t value, unsigned char *byteArray, int startIndex);
 void uint64ToBytes(uint64_t value, unsigned char *byteArray, int startIndex);
 void uintToBytes(uintmax_t value, unsigned char *byteArray, int startIndex,
                  size_t numBytes);
+uint32_t checksumBytes(unsigned char *bytes, size_t length);
 char *charArrayToString(char *arr, uint16_t len);
 char *stringToCharArray(char *arr);
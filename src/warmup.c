@@ -0,0 +1,138 @@
+#include "warmup.h"
+#include "btree.h"
+#include "latch.h"
+#include "storage.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+Writes the most read pages to the hot page list and points the header at
+it. A list that didn't change isn't rewritten, and nothing is synced: the
+list is only a hint, and closing after a read mustn't cost a disk flush.
+In-memory trees have nothing to warm up.
+Returns 1 on success, 0 on a write error.
+*/
+int saveHotPages(BTree *tree) {
+  if (tree->storage->kind == STORAGE_MEMORY) {
+    return 1;
+  }
+
+  NodePointer hottest[HOT_PAGES_MAX];
+  int found = latchHottest(tree->latches, hottest, HOT_PAGES_MAX);
+
+  // Counts from before a compaction name pages of the old file
+  unsigned char page[BTREE_PAGE_SIZE];
+  memset(page, 0, BTREE_PAGE_SIZE);
+  uint16_t count = 0;
+  for (int i = 0; i < found; i++) {
+    if (hottest[i] >= BTREE_PAGE_SIZE && hottest[i] < tree->last) {
+      uint64ToBytes(hottest[i], page, 2 + count * 8);
+      count++;
+    }
+  }
+  if (count == 0) {
+    return 1;
+  }
+  uint16ToBytes(count, page, 0);
+
+  if (tree->hotPages != 0) {
+    unsigned char saved[BTREE_PAGE_SIZE];
+    memset(saved, 0, BTREE_PAGE_SIZE);
+    storageRead(tree->storage, saved, BTREE_PAGE_SIZE, tree->hotPages);
+    if (memcmp(saved, page, 2 + count * 8) == 0) {
+      return 1;
+    }
+  }
+
+  int allocated = tree->hotPages == 0;
+  if (allocated) {
+    tree->hotPages = allocatePage(tree);
+  }
+  if (storageWrite(tree->storage, page, BTREE_PAGE_SIZE, tree->hotPages) !=
+      BTREE_PAGE_SIZE) {
+    printf("Failed to write the hot page list\n");
+    return 0;
+  }
+  if (allocated) {
+    updateTreeInFile(tree);
+  }
+  return 1;
+}
+
+static int byOffset(const void *a, const void *b) {
+  NodePointer pageA = *(const NodePointer *)a;
+  NodePointer pageB = *(const NodePointer *)b;
+  return pageA < pageB ? -1 : pageA > pageB ? 1 : 0;
+}
+
+// Prefetches the listed pages in file order, adjacent pages as one range
+static void *warmupRun(void *argument) {
+  Warmup *warmup = argument;
+  unsigned char page[BTREE_PAGE_SIZE];
+  memset(page, 0, BTREE_PAGE_SIZE);
+  if (storageRead(warmup->storage, page, BTREE_PAGE_SIZE, warmup->list) < 2) {
+    return NULL;
+  }
+
+  uint16_t count = bytesToUInt16(page, 0);
+  if (count > HOT_PAGES_MAX) {
+    return NULL;
+  }
+  NodePointer pages[HOT_PAGES_MAX];
+  int kept = 0;
+  for (uint16_t i = 0; i < count; i++) {
+    NodePointer hot = bytesToUInt64(page, 2 + i * 8);
+    if (hot % BTREE_PAGE_SIZE == 0 && hot < warmup->last) {
+      pages[kept++] = hot;
+    }
+  }
+  qsort(pages, kept, sizeof(NodePointer), byOffset);
+
+  int start = 0;
+  for (int i = 1; i <= kept; i++) {
+    if (i < kept && pages[i] == pages[i - 1] + BTREE_PAGE_SIZE) {
+      continue;
+    }
+    storagePrefetch(warmup->storage, pages[start],
+                    pages[i - 1] - pages[start] + BTREE_PAGE_SIZE);
+    start = i;
+  }
+  return NULL;
+}
+
+/*
+Starts prefetching the hot pages of a tree that was just opened. Only the
+header has been read at this point, the list itself is read in the
+background too.
+Returns NULL when there is nothing to warm up.
+*/
+Warmup *startWarmup(BTree *tree) {
+  if (tree->hotPages == 0) {
+    return NULL;
+  }
+
+  Warmup *warmup = malloc(sizeof(Warmup));
+  if (warmup == NULL) {
+    return NULL; // Only slower
+  }
+  warmup->storage = tree->storage;
+  warmup->list = tree->hotPages;
+  warmup->last = tree->last;
+
+  if (pthread_create(&warmup->thread, NULL, warmupRun, warmup) != 0) {
+    free(warmup);
+    return NULL;
+  }
+  return warmup;
+}
+
+// Waits for the prefetch to end, the storage must outlive it
+void finishWarmup(Warmup *warmup) {
+  if (warmup == NULL) {
+    return;
+  }
+  pthread_join(warmup->thread, NULL);
+  free(warmup);
+}
@@ -0,0 +1,30 @@
+#ifndef WARMUP_H
+#define WARMUP_H
+
+#include "btree.h"
+#include <pthread.h>
+
+/*
+Hot page list, written in one page by closeTree:
+| count |   pages    |
+|  2B   | count * 8B |
+*/
+#define HOT_PAGES_MAX ((BTREE_PAGE_SIZE - 2) / 8)
+
+/*
+Background prefetch of the pages listed at the last clean close, so a
+restarted process doesn't have to fault the hot part of the tree in one
+lookup at a time.
+*/
+typedef struct Warmup {
+  struct Storage *storage;
+  NodePointer list; // Page holding the hot page list
+  NodePointer last; // End of the tree, anything past it is stale
+  pthread_t thread;
+} Warmup;
+
+int saveHotPages(BTree *tree);
+Warmup *startWarmup(BTree *tree);
+void finishWarmup(Warmup *warmup);
+
+#endif // WARMUP_H